@@ -1,156 +1,432 @@
 #include "evalable.h"
 #include "measurements.h"
+#include <algorithm>
+#include <cmath>
 #include <fmt/format.h>
+#include <limits>
 #include <map>
+#include <thread>
 
 namespace loadl {
 
-evaluator::evaluator(results &res) : res_{res} {}
+evaluator::evaluator(results &res, unsigned threads) : res_{res}, threads_{threads} {}
 
-void evaluator::evaluate(const std::string &name, const std::vector<std::string> &used_observables,
-                         func fun) {
+// calls f(begin, end) for contiguous ranges of [0, count) from up to threads threads.
+template<class F>
+static void split_between_threads(unsigned threads, size_t count, F f) {
+	threads = std::max<size_t>(1, std::min<size_t>(threads, count));
+	if(threads == 1) {
+		f(0, count);
+		return;
+	}
+
+	std::vector<std::thread> workers;
+	std::vector<std::exception_ptr> errors(threads);
+	for(size_t t = 0; t < threads; t++) {
+		workers.emplace_back([&, t]() {
+			try {
+				f(count * t / threads, count * (t + 1) / threads);
+			} catch(...) {
+				errors[t] = std::current_exception();
+			}
+		});
+	}
+	for(auto &worker : workers) {
+		worker.join();
+	}
+	for(auto &error : errors) {
+		if(error) {
+			std::rethrow_exception(error);
+		}
+	}
+}
+
+static void check_evalable_name(const std::string &name) {
 	// evalable names also should be valid HDF5 paths
 	if(not measurements::observable_name_is_legal(name)) {
 		throw std::runtime_error{
 		    fmt::format("illegal evalable name '{}': must not contain . or /", name)};
 	}
+}
 
-	observable_result o = jackknife(name, used_observables, fun);
+void evaluator::evaluate(const std::string &name, const std::vector<std::string> &used_observables,
+                         func fun, error_method method, gradient_func gradient) {
+	check_evalable_name(name);
+	auto evaluate = [this, name, used_observables, fun, method, gradient]() {
+		evaluate_now(name, used_observables, fun, method, gradient);
+	};
+	pending_.push_back({used_observables, evaluate});
+	evaluate_ready();
+}
 
-	// don’t include empty results
-	if(o.rebinning_bin_count > 0) {
-		evalable_results_.emplace_back(o);
-	}
+void evaluator::evaluate_batch(const std::string &name,
+                               const std::vector<std::string> &used_observables, batch_func fun) {
+	check_evalable_name(name);
+	auto evaluate = [this, name, used_observables, fun]() {
+		evaluate_batch_now(name, used_observables, fun);
+	};
+	pending_.push_back({used_observables, evaluate});
+	evaluate_ready();
 }
 
-void evaluator::append_results() {
-	for(auto &eval : evalable_results_) {
-		res_.observables.emplace(eval.name, eval);
+void evaluator::evaluate_ready() {
+	for(size_t i = 0; i < pending_.size();) {
+		if(used_results(pending_[i].used_observables).empty()) {
+			i++;
+			continue;
+		}
+
+		// the new result may be what earlier pending evalables are waiting for.
+		auto evalable = std::move(pending_[i]);
+		pending_.erase(pending_.begin() + i);
+		evalable.evaluate();
+		i = 0;
 	}
 }
 
-observable_result evaluator::jackknife(const std::string &name,
-                                       const std::vector<std::string> &used_observables,
-                                       func fun) const {
-	observable_result obs_res;
+void evaluator::evaluate_now(const std::string &name,
+                             const std::vector<std::string> &used_observables, const func &fun,
+                             error_method method, const gradient_func &gradient) {
+	auto observables = used_results(used_observables);
+	size_t bin_count = common_bin_count(observables);
+	// don’t include empty results
+	if(bin_count == 0) {
+		return;
+	}
 
-	std::vector<observable_result> observables;
-	observables.reserve(used_observables.size());
+	if(method == error_method::delta) {
+		evalable_results_.emplace_back(
+		    delta_method(name, observables, bin_count, fun, gradient));
+		return;
+	}
 
-	obs_res.name = name;
+	std::vector<std::vector<double>> samples;
+	for(const auto *obs : observables) {
+		samples.push_back(jackknife_samples(*obs, bin_count));
+	}
 
-	size_t bin_count = -1; // maximal value
-	for(const auto &obs_name : used_observables) {
-		if(res_.observables.count(obs_name) <= 0) {
-			// skip evalable if ingredients are missing from the measurements
-			return obs_res;
+	auto jacked_sample = [&](size_t k, std::vector<std::vector<double>> &jacked_means) {
+		for(size_t obs_idx = 0; obs_idx < observables.size(); obs_idx++) {
+			size_t vector_length = observables[obs_idx]->mean.size();
+			auto first = samples[obs_idx].begin() + k * vector_length;
+			jacked_means[obs_idx].assign(first, first + vector_length);
 		}
-		const auto &obs = res_.observables.at(obs_name);
+	};
 
-		if(obs.rebinning_bin_count < bin_count) {
-			bin_count = obs.rebinning_bin_count;
+	std::vector<std::vector<double>> jacked_means(observables.size());
+	jacked_sample(bin_count, jacked_means);
+	std::vector<double> complete_eval = fun(jacked_means);
+	size_t eval_length = complete_eval.size();
+
+	std::vector<double> evals((bin_count + 1) * eval_length);
+	std::copy(complete_eval.begin(), complete_eval.end(),
+	          evals.begin() + bin_count * eval_length);
+
+	auto eval_bins = [&](size_t begin, size_t end) {
+		std::vector<std::vector<double>> jacked_means(observables.size());
+		for(size_t k = begin; k < end; k++) {
+			jacked_sample(k, jacked_means);
+			std::vector<double> jacked_eval = fun(jacked_means);
+			if(jacked_eval.size() != eval_length) {
+				throw std::runtime_error(fmt::format(
+				    "evalable '{}': evalables must not change their dimensions depending "
+				    "on the input",
+				    name));
+			}
+			std::copy(jacked_eval.begin(), jacked_eval.end(), evals.begin() + k * eval_length);
 		}
+	};
 
-		observables.emplace_back(obs);
-	}
+	split_between_threads(threads_, bin_count, eval_bins);
+
+	evalable_results_.emplace_back(jackknife(name, bin_count, evals));
+}
 
+void evaluator::evaluate_batch_now(const std::string &name,
+                                   const std::vector<std::string> &used_observables,
+                                   const batch_func &fun) {
+	auto observables = used_results(used_observables);
+	size_t bin_count = common_bin_count(observables);
+	// don’t include empty results
 	if(bin_count == 0) {
-		return obs_res;
+		return;
+	}
+
+	std::vector<std::vector<double>> samples;
+	for(const auto *obs : observables) {
+		samples.push_back(jackknife_samples(*obs, bin_count));
+	}
+
+	std::vector<double> evals = fun(samples, bin_count + 1);
+	if(evals.size() % (bin_count + 1) != 0) {
+		throw std::runtime_error(
+		    fmt::format("evalable '{}': batch evalables must return one result of the same "
+		                "length for every sample",
+		                name));
 	}
+
+	evalable_results_.emplace_back(jackknife(name, bin_count, evals));
+}
+
+observable_result evaluator::delta_method(const std::string &name,
+                                         const std::vector<const observable_result *> &observables,
+                                         size_t bin_count, const func &fun,
+                                         const gradient_func &gradient) const {
+	observable_result obs_res;
+	obs_res.name = name;
 	obs_res.rebinning_bin_count = bin_count;
 
-	std::vector<std::vector<double>> jacked_means(observables.size());
-	std::vector<std::vector<double>> sums(observables.size());
+	// all components of all observables are numbered one after the other. func is linearized
+	// around the complete jackknife sample, the deviations are those of the bins from their mean.
+	std::vector<std::vector<double>> means;
+	std::vector<std::vector<double>> bin_means;
+	std::vector<size_t> offsets{0};
+	for(const auto *obs : observables) {
+		size_t vector_length = obs->mean.size();
+		auto samples = jackknife_samples(*obs, bin_count);
+		means.emplace_back(samples.begin() + bin_count * vector_length, samples.end());
 
-	for(size_t obs_idx = 0; obs_idx < observables.size(); obs_idx++) {
-		size_t vector_length = observables[obs_idx].mean.size();
-		sums[obs_idx].resize(vector_length, 0);
-		jacked_means[obs_idx].resize(vector_length);
-		for(size_t i = 0; i < vector_length; i++) {
-			for(size_t k = 0; k < bin_count; k++) {
-				sums[obs_idx][i] += observables[obs_idx].rebinning_means[k * vector_length + i];
-			}
+		bin_means.push_back(sums(*obs, bin_count));
+		for(auto &mean : bin_means.back()) {
+			mean /= bin_count;
 		}
+		offsets.push_back(offsets.back() + vector_length);
 	}
+	size_t input_length = offsets.back();
 
-	// calculate the function estimator from the jacked datasets
-	std::vector<double> jacked_eval_mean;
-	for(size_t k = 0; k < bin_count; k++) {
+	auto deviations = [&](size_t k, std::vector<double> &deviation) {
+		deviation.resize(input_length);
 		for(size_t obs_idx = 0; obs_idx < observables.size(); obs_idx++) {
-			size_t vector_length = observables[obs_idx].mean.size();
-			jacked_means[obs_idx].resize(vector_length);
-
+			size_t vector_length = means[obs_idx].size();
 			for(size_t i = 0; i < vector_length; i++) {
-				jacked_means[obs_idx][i] =
-				    (sums[obs_idx][i] -
-				     observables[obs_idx].rebinning_means[k * vector_length + i]) /
-				    (bin_count - 1);
+				deviation[offsets[obs_idx] + i] =
+				    observables[obs_idx]->rebinning_means[k * vector_length + i] -
+				    bin_means[obs_idx][i];
 			}
 		}
+	};
+
+	obs_res.mean = fun(means);
+	size_t eval_length = obs_res.mean.size();
 
-		std::vector<double> jacked_eval = fun(jacked_means);
-		if(jacked_eval_mean.empty())
-			jacked_eval_mean.resize(jacked_eval.size(), 0);
-		if(jacked_eval_mean.size() != jacked_eval.size()) {
-			throw std::runtime_error(
-			    fmt::format("evalable '{}': evalables must not change their dimensions depending "
-			                "on the input",
-			                name));
+	auto wrong_dimensions = [&]() {
+		return std::runtime_error(fmt::format(
+		    "evalable '{}': evalables must not change their dimensions depending on the input",
+		    name));
+	};
+
+	if(eval_length * input_length > max_jacobian_size) {
+		throw std::runtime_error(fmt::format(
+		    "evalable '{}': the delta method needs a {}x{} Jacobian, which is too large. Use the "
+		    "jackknife or evaluate_batch instead.",
+		    name, eval_length, input_length));
+	}
+	std::vector<double> jacobian(eval_length * input_length);
+	if(gradient) {
+		auto grad = gradient(means);
+		if(grad.size() != eval_length) {
+			throw wrong_dimensions();
+		}
+		for(size_t i = 0; i < eval_length; i++) {
+			if(grad[i].size() != input_length) {
+				throw std::runtime_error(fmt::format(
+				    "evalable '{}': the gradient needs one entry per observable component",
+				    name));
+			}
+			std::copy(grad[i].begin(), grad[i].end(), jacobian.begin() + i * input_length);
 		}
+	} else {
+		// The step is the usual cbrt(eps) relative to |x0|. For components much smaller than
+		// their statistical error, it is relative to the error instead.
+		std::vector<double> errors(input_length, 0);
+		std::vector<double> deviation;
+		for(size_t k = 0; k < bin_count; k++) {
+			deviations(k, deviation);
+			for(size_t j = 0; j < input_length; j++) {
+				errors[j] += deviation[j] * deviation[j];
+			}
+		}
+
+		split_between_threads(threads_, input_length, [&](size_t begin, size_t end) {
+			auto shifted = means;
+			for(size_t j = begin; j < end; j++) {
+				size_t obs_idx =
+				    std::upper_bound(offsets.begin(), offsets.end(), j) - offsets.begin() - 1;
+				double &x = shifted[obs_idx][j - offsets[obs_idx]];
+				double x0 = x;
 
-		for(size_t i = 0; i < jacked_eval.size(); i++) {
-			jacked_eval_mean[i] += jacked_eval[i];
+				double error = sqrt(errors[j] / bin_count / (bin_count - 1));
+				double h = std::cbrt(std::numeric_limits<double>::epsilon()) *
+				           std::max(std::abs(x0), error);
+				if(h == 0) {
+					h = std::cbrt(std::numeric_limits<double>::epsilon());
+				}
+
+				x = x0 + h;
+				double x_up = x;
+				std::vector<double> up = fun(shifted);
+				x = x0 - h;
+				double x_down = x;
+				std::vector<double> down = fun(shifted);
+				x = x0;
+
+				if(up.size() != eval_length || down.size() != eval_length) {
+					throw wrong_dimensions();
+				}
+				for(size_t i = 0; i < eval_length; i++) {
+					jacobian[i * input_length + j] = (up[i] - down[i]) / (x_up - x_down);
+				}
+			}
+		});
+	}
+
+	// the covariance of the means is (1/(n(n-1))) sum_k deviation_k deviation_k^T, so the
+	// variance of the linearized evalable is a sum over the projected deviations. They also give
+	// the linearized bins and jackknife samples.
+	obs_res.error.resize(eval_length, 0);
+	obs_res.rebinning_means.resize(bin_count * eval_length);
+	obs_res.jackknife_samples.resize((bin_count + 1) * eval_length);
+	std::copy(obs_res.mean.begin(), obs_res.mean.end(),
+	          obs_res.jackknife_samples.begin() + bin_count * eval_length);
+	std::vector<double> deviation;
+	for(size_t k = 0; k < bin_count; k++) {
+		deviations(k, deviation);
+		for(size_t i = 0; i < eval_length; i++) {
+			double projected = 0;
+			for(size_t j = 0; j < input_length; j++) {
+				projected += jacobian[i * input_length + j] * deviation[j];
+			}
+			obs_res.error[i] += projected * projected;
+			obs_res.rebinning_means[k * eval_length + i] = obs_res.mean[i] + projected;
+			obs_res.jackknife_samples[k * eval_length + i] =
+			    obs_res.mean[i] - projected / (bin_count - 1);
 		}
 	}
+	for(auto &error : obs_res.error) {
+		error = sqrt(error / bin_count / (bin_count - 1));
+	}
 
-	for(size_t i = 0; i < jacked_eval_mean.size(); i++) {
-		jacked_eval_mean[i] /= bin_count;
+	return obs_res;
+}
+
+void evaluator::append_results() {
+	for(auto &eval : evalable_results_) {
+		res_.observables.emplace(eval.name, eval);
 	}
+}
 
-	// calculate the function estimator from the complete dataset.
-	for(size_t obs_idx = 0; obs_idx < observables.size(); obs_idx++) {
-		jacked_means[obs_idx] = sums[obs_idx];
-		for(auto &jacked_mean : jacked_means[obs_idx]) {
-			jacked_mean /= bin_count;
+std::vector<const observable_result *>
+evaluator::used_results(const std::vector<std::string> &used_observables) const {
+	std::vector<const observable_result *> observables;
+	observables.reserve(used_observables.size());
+
+	for(const auto &obs_name : used_observables) {
+		auto it = res_.observables.find(obs_name);
+		if(it != res_.observables.end()) {
+			observables.push_back(&it->second);
+			continue;
+		}
+
+		auto eval_it = std::find_if(evalable_results_.begin(), evalable_results_.end(),
+		                            [&](const auto &eval) { return eval.name == obs_name; });
+		if(eval_it == evalable_results_.end()) {
+			return {};
 		}
+		observables.push_back(&*eval_it);
 	}
 
-	std::vector<double> complete_eval = fun(jacked_means);
-	assert(complete_eval.size() == jacked_eval_mean.size());
+	return observables;
+}
 
-	// calculate bias-corrected jackknife estimator
-	obs_res.mean.resize(jacked_eval_mean.size());
-	for(size_t i = 0; i < obs_res.mean.size(); i++) {
-		obs_res.mean[i] = bin_count * complete_eval[i] - (bin_count - 1) * jacked_eval_mean[i];
+size_t evaluator::common_bin_count(const std::vector<const observable_result *> &observables) {
+	if(observables.empty()) {
+		return 0;
 	}
 
-	// now for the error
+	size_t bin_count = -1; // maximal value
+	for(const auto *obs : observables) {
+		bin_count = std::min(bin_count, obs->rebinning_bin_count);
+	}
+	return bin_count;
+}
+
+std::vector<double> evaluator::jackknife_samples(const observable_result &obs,
+                                                size_t bin_count) {
+	size_t vector_length = obs.mean.size();
+	if(obs.jackknife_samples.size() == (bin_count + 1) * vector_length) {
+		return obs.jackknife_samples;
+	}
+
+	std::vector<double> obs_sums = sums(obs, bin_count);
+	std::vector<double> samples((bin_count + 1) * vector_length);
 	for(size_t k = 0; k < bin_count; k++) {
-		for(size_t obs_idx = 0; obs_idx < observables.size(); obs_idx++) {
-			size_t vector_length = observables[obs_idx].mean.size();
-			jacked_means[obs_idx].resize(vector_length);
+		for(size_t i = 0; i < vector_length; i++) {
+			samples[k * vector_length + i] =
+			    (obs_sums[i] - obs.rebinning_means[k * vector_length + i]) / (bin_count - 1);
+		}
+	}
+	for(size_t i = 0; i < vector_length; i++) {
+		samples[bin_count * vector_length + i] = obs_sums[i] / bin_count;
+	}
+	return samples;
+}
 
-			for(size_t i = 0; i < vector_length; i++) {
-				jacked_means[obs_idx][i] =
-				    (sums[obs_idx][i] -
-				     observables[obs_idx].rebinning_means[k * vector_length + i]) /
-				    (bin_count - 1);
-			}
+std::vector<double> evaluator::sums(const observable_result &obs, size_t bin_count) {
+	size_t vector_length = obs.mean.size();
+	std::vector<double> sums(vector_length, 0);
+	for(size_t i = 0; i < vector_length; i++) {
+		for(size_t k = 0; k < bin_count; k++) {
+			sums[i] += obs.rebinning_means[k * vector_length + i];
 		}
+	}
+	return sums;
+}
+
+observable_result evaluator::jackknife(const std::string &name, size_t bin_count,
+                                       const std::vector<double> &evals) {
+	observable_result obs_res;
+	obs_res.name = name;
+	obs_res.rebinning_bin_count = bin_count;
 
-		std::vector<double> jacked_eval = fun(jacked_means);
-		if(obs_res.error.empty()) {
-			obs_res.error.resize(jacked_eval.size(), 0);
+	size_t eval_length = evals.size() / (bin_count + 1);
+	const double *complete_eval = &evals[bin_count * eval_length];
+
+	std::vector<double> jacked_eval_mean(eval_length, 0);
+	for(size_t k = 0; k < bin_count; k++) {
+		for(size_t i = 0; i < eval_length; i++) {
+			jacked_eval_mean[i] += evals[k * eval_length + i];
 		}
+	}
+	for(size_t i = 0; i < eval_length; i++) {
+		jacked_eval_mean[i] /= bin_count;
+	}
 
-		for(size_t i = 0; i < obs_res.error.size(); i++) {
-			obs_res.error[i] += pow(jacked_eval[i] - jacked_eval_mean[i], 2);
+	// calculate bias-corrected jackknife estimator
+	obs_res.mean.resize(eval_length);
+	for(size_t i = 0; i < eval_length; i++) {
+		obs_res.mean[i] = bin_count * complete_eval[i] - (bin_count - 1) * jacked_eval_mean[i];
+	}
+
+	// now for the error
+	obs_res.error.resize(eval_length, 0);
+	for(size_t k = 0; k < bin_count; k++) {
+		for(size_t i = 0; i < eval_length; i++) {
+			obs_res.error[i] += pow(evals[k * eval_length + i] - jacked_eval_mean[i], 2);
 		}
 	}
-	for(size_t i = 0; i < obs_res.error.size(); i++) {
+	for(size_t i = 0; i < eval_length; i++) {
 		obs_res.error[i] = sqrt((bin_count - 1) * obs_res.error[i] / bin_count);
 	}
 
+	obs_res.jackknife_samples = evals;
+	obs_res.rebinning_means.resize(bin_count * eval_length);
+	for(size_t k = 0; k < bin_count; k++) {
+		for(size_t i = 0; i < eval_length; i++) {
+			obs_res.rebinning_means[k * eval_length + i] =
+			    bin_count * complete_eval[i] - (bin_count - 1.) * evals[k * eval_length + i];
+		}
+	}
+
 	return obs_res;
 }
 }
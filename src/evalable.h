@@ -19,19 +19,88 @@ public:
 	typedef std::function<std::vector<double>(const std::vector<std::vector<double>> &observables)>
 	    func;
 
-	evaluator(results &res);
+	// For expensive evalables, a batch function gets all jackknife samples at once
+	//
+	// std::vector<double> calculate_stuff(const std::vector<std::vector<double>>& samples,
+	//                                     size_t sample_count);
+	//
+	// samples[i] holds sample_count samples of the i-th observable one after the other, so the
+	// k-th sample of an observable with vector length n starts at samples[i][k*n]. It returns
+	// sample_count results one after the other.
+	typedef std::function<std::vector<double>(const std::vector<std::vector<double>> &samples,
+	                                          size_t sample_count)>
+	    batch_func;
+
+	// Optionally, the gradient of func
+	//
+	// std::vector<std::vector<double>> calculate_gradient(const std::vector<std::vector<double>>&
+	//                                                     obs);
+	//
+	// returns for every result component a vector with the derivatives by all components of all
+	// observables, one observable after the other.
+	typedef std::function<std::vector<std::vector<double>>(
+	    const std::vector<std::vector<double>> &observables)>
+	    gradient_func;
+
+	// jackknife evaluates func for every bin. delta linearizes func around the mean, using the
+	// gradient or numerical derivatives, which is faster when there are many more bins than
+	// observable components. It gives the mean without bias correction. It keeps the whole
+	// Jacobian in memory and refuses evalables where that has more than max_jacobian_size
+	// entries.
+	enum class error_method { jackknife, delta };
+	static const size_t max_jacobian_size = 1 << 24;
+
+	// with threads > 1, func is called from several threads at once.
+	evaluator(results &res, unsigned threads = 1);
+
+	// Evalables can use other evalables, also ones that are registered later. An evalable is
+	// evaluated as soon as everything it uses is there, and skipped if that never happens.
 	void evaluate(const std::string &name, const std::vector<std::string> &used_observables,
-	              func fun);
+	              func fun, error_method method = error_method::jackknife,
+	              gradient_func gradient = {});
+	void evaluate_batch(const std::string &name, const std::vector<std::string> &used_observables,
+	                    batch_func fun);
 
 	// appends the evalable results to the other observables in res
 	void append_results();
 
 private:
+	struct pending_evalable {
+		std::vector<std::string> used_observables;
+		std::function<void()> evaluate;
+	};
+
+	// Evalables keep their jackknife_samples, so that evalables using them get the same samples
+	// as if they had calculated them themselves. Their rebinning_means are the pseudovalues
+	// bin_count*complete_eval - (bin_count-1)*jacked_eval.
 	std::vector<observable_result> evalable_results_;
+	std::vector<pending_evalable> pending_;
 	results &res_;
+	unsigned threads_;
+
+	void evaluate_ready();
+	void evaluate_now(const std::string &name, const std::vector<std::string> &used_observables,
+	                  const func &fun, error_method method, const gradient_func &gradient);
+	void evaluate_batch_now(const std::string &name,
+	                        const std::vector<std::string> &used_observables,
+	                        const batch_func &fun);
+
+	// the used observables or an empty vector if some are missing.
+	std::vector<const observable_result *>
+	used_results(const std::vector<std::string> &used_observables) const;
+	static size_t common_bin_count(const std::vector<const observable_result *> &observables);
+	static std::vector<double> sums(const observable_result &obs, size_t bin_count);
+	// the bin_count samples leaving out one bin each, followed by the complete dataset.
+	static std::vector<double> jackknife_samples(const observable_result &obs, size_t bin_count);
 
-	observable_result jackknife(const std::string &name,
-	                            const std::vector<std::string> &used_observables, func fun) const;
+	// evals holds the evaluations for the bin_count jackknife samples, followed by the one for
+	// the complete dataset.
+	static observable_result jackknife(const std::string &name, size_t bin_count,
+	                                   const std::vector<double> &evals);
+	observable_result delta_method(const std::string &name,
+	                               const std::vector<const observable_result *> &observables,
+	                               size_t bin_count, const func &fun,
+	                               const gradient_func &gradient) const;
 };
 
 }
@@ -142,6 +142,49 @@ iodump iodump::open_readwrite(const std::string &filename) {
 	return iodump{filename, file};
 }
 
+iodump iodump::create_in_memory(const std::string &filename) {
+	H5Eset_auto(H5E_DEFAULT, nullptr, nullptr);
+
+	h5_handle fapl{H5Pcreate(H5P_FILE_ACCESS), H5Pclose};
+	const size_t increment = 1 << 20;
+	herr_t status = H5Pset_fapl_core(*fapl, increment, false);
+	if(status < 0) {
+		throw iodump_exception{filename, "H5Pset_fapl_core"};
+	}
+
+	hid_t file = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, *fapl);
+	if(file < 0) {
+		throw iodump_exception{filename, "H5Fcreate"};
+	}
+
+	return iodump{filename, file};
+}
+
+std::vector<char> iodump::get_file_image() {
+	herr_t status = H5Fflush(h5_file_, H5F_SCOPE_GLOBAL);
+	if(status < 0) {
+		throw iodump_exception{filename_, "H5Fflush"};
+	}
+
+	ssize_t size = H5Fget_file_image(h5_file_, nullptr, 0);
+	if(size < 0) {
+		throw iodump_exception{filename_, "H5Fget_file_image"};
+	}
+
+	std::vector<char> image(size);
+	size = H5Fget_file_image(h5_file_, image.data(), image.size());
+	if(size < 0) {
+		throw iodump_exception{filename_, "H5Fget_file_image"};
+	}
+
+	return image;
+}
+
+std::recursive_mutex &iodump::mutex() {
+	static std::recursive_mutex m;
+	return m;
+}
+
 iodump::iodump(std::string filename, hid_t h5_file)
     : filename_{std::move(filename)}, h5_file_{h5_file} {
 	if(compression_filter_ != 0 && !filter_available(compression_filter_)) {
@@ -160,7 +203,7 @@ iodump::group iodump::get_root() {
 iodump::h5_handle iodump::group::create_dataset(const std::string &name, hid_t datatype,
                                                 hsize_t size, hsize_t chunk_size,
                                                 H5Z_filter_t compression_filter,
-                                                bool unlimited) const {
+                                                bool unlimited, hsize_t row_length) const {
 	herr_t status;
 
 	if(exists(name)) {
@@ -179,19 +222,19 @@ iodump::h5_handle iodump::group::create_dataset(const std::string &name, hid_t d
 
 		return dataset;
 	} else {
-		hid_t dataspace_h;
-		if(!unlimited) {
-			dataspace_h = H5Screate_simple(1, &size, nullptr);
-		} else {
-			hsize_t maxdim = H5S_UNLIMITED;
-			dataspace_h = H5Screate_simple(1, &size, &maxdim);
-		}
-		h5_handle dataspace{dataspace_h, H5Sclose};
+		int rank = row_length == 0 ? 1 : 2;
+		hsize_t dims[2] = {size, row_length};
+		hsize_t maxdims[2] = {H5S_UNLIMITED, row_length};
+		hsize_t chunk_dims[2] = {chunk_size, row_length};
+
+		h5_handle dataspace{H5Screate_simple(rank, dims, unlimited ? maxdims : nullptr),
+		                    H5Sclose};
 
 		h5_handle plist{H5Pcreate(H5P_DATASET_CREATE), H5Pclose};
 
-		if(chunk_size > 1) { // do not use compression on small datasets
-			status = H5Pset_chunk(*plist, 1, &chunk_size);
+		// do not use compression on small datasets
+		if(chunk_size > 1 || (rank == 2 && unlimited)) {
+			status = H5Pset_chunk(*plist, rank, chunk_dims);
 			if(status < 0) {
 				throw iodump_exception{filename_, "H5Pset_chunk"};
 			}
@@ -210,6 +253,114 @@ iodump::h5_handle iodump::group::create_dataset(const std::string &name, hid_t d
 	}
 }
 
+void iodump::group::reserve_dataset(const std::string &name, hid_t datatype, hsize_t size,
+                                    hsize_t row_length) const {
+	int rank = row_length == 0 ? 1 : 2;
+	hsize_t rows = row_length == 0 ? size : size / row_length;
+	hsize_t dims[2] = {2 * rows, row_length};
+
+	if(!exists(name)) {
+		hsize_t maxdims[2] = {H5S_UNLIMITED, row_length};
+		hsize_t chunk_dims[2] = {
+		    row_length == 0 ? chunk_size_ : std::max<hsize_t>(1, chunk_size_ / row_length),
+		    row_length};
+
+		h5_handle dataspace{H5Screate_simple(rank, dims, maxdims), H5Sclose};
+		h5_handle plist{H5Pcreate(H5P_DATASET_CREATE), H5Pclose};
+		herr_t status = H5Pset_chunk(*plist, rank, chunk_dims);
+		if(status < 0) {
+			throw iodump_exception{filename_, "H5Pset_chunk"};
+		}
+		status = H5Pset_alloc_time(*plist, H5D_ALLOC_TIME_EARLY);
+		if(status < 0) {
+			throw iodump_exception{filename_, "H5Pset_alloc_time"};
+		}
+
+		h5_handle dataset{H5Dcreate2(group_, name.c_str(), datatype, *dataspace, H5P_DEFAULT,
+		                             *plist, H5P_DEFAULT),
+		                  H5Dclose};
+		return;
+	}
+
+	h5_handle dataset{H5Dopen2(group_, name.c_str(), H5P_DEFAULT), H5Dclose};
+	hsize_t old_dims[2] = {0, 1};
+	{
+		h5_handle dataspace{H5Dget_space(*dataset), H5Sclose};
+		if(H5Sget_simple_extent_ndims(*dataspace) != rank) {
+			throw iodump_exception{filename_,
+			                       fmt::format("{} does not have rank {}", name, rank)};
+		}
+		H5Sget_simple_extent_dims(*dataspace, old_dims, nullptr);
+	}
+	if(rank == 2 && old_dims[1] != row_length) {
+		throw std::runtime_error{
+		    "iodump: tried to reserve rows of a different length in an existing dataset!"};
+	}
+	if(old_dims[0] >= rows) {
+		return;
+	}
+
+	herr_t status = H5Dset_extent(*dataset, dims);
+	if(status < 0) {
+		throw iodump_exception{filename_, "H5Dset_extent"};
+	}
+}
+
+iodump::h5_handle iodump::group::open_table(const std::string &name, hid_t datatype, int rank,
+                                            hsize_t row_count, hsize_t row_length,
+                                            const void *fill_value, hsize_t *dims) const {
+	herr_t status;
+	if(!exists(name)) {
+		// rows can be widened later, so the columns are chunked.
+		hsize_t create_dims[2] = {row_count, row_length};
+		hsize_t maxdims[2] = {row_count, H5S_UNLIMITED};
+		hsize_t chunk_dims[2] = {1, std::clamp<hsize_t>(row_length, 1, chunk_size_)};
+
+		h5_handle dataspace{
+		    H5Screate_simple(rank, create_dims, rank == 2 ? maxdims : nullptr), H5Sclose};
+		h5_handle plist{H5Pcreate(H5P_DATASET_CREATE), H5Pclose};
+		if(rank == 2) {
+			status = H5Pset_chunk(*plist, rank, chunk_dims);
+			if(status < 0) {
+				throw iodump_exception{filename_, "H5Pset_chunk"};
+			}
+		}
+		status = H5Pset_fill_value(*plist, datatype, fill_value);
+		if(status < 0) {
+			throw iodump_exception{filename_, "H5Pset_fill_value"};
+		}
+
+		h5_handle created{H5Dcreate2(group_, name.c_str(), datatype, *dataspace, H5P_DEFAULT,
+		                             *plist, H5P_DEFAULT),
+		                  H5Dclose};
+	}
+
+	h5_handle dataset{H5Dopen2(group_, name.c_str(), H5P_DEFAULT), H5Dclose};
+	{
+		h5_handle dataspace{H5Dget_space(*dataset), H5Sclose};
+		if(H5Sget_simple_extent_ndims(*dataspace) != rank) {
+			throw iodump_exception{filename_,
+			                       fmt::format("{} does not have rank {}", name, rank)};
+		}
+		dims[1] = 1;
+		H5Sget_simple_extent_dims(*dataspace, dims, nullptr);
+	}
+	if(dims[0] != row_count) {
+		throw std::runtime_error{
+		    "iodump: tried to write into an existing table with a different number of rows!"};
+	}
+
+	if(rank == 2 && dims[1] < row_length) {
+		dims[1] = row_length;
+		status = H5Dset_extent(*dataset, dims);
+		if(status < 0) {
+			throw iodump_exception{filename_, "H5Dset_extent"};
+		}
+	}
+
+	return dataset;
+}
+
 iodump::group iodump::group::open_group(const std::string &path) const {
 	return group{group_, filename_, path};
 }
@@ -226,6 +377,36 @@ size_t iodump::group::get_extent(const std::string &name) const {
 	return size;
 }
 
+void iodump::group::truncate(const std::string &name, size_t size) const {
+	h5_handle dataset{H5Dopen2(group_, name.c_str(), H5P_DEFAULT), H5Dclose};
+
+	hsize_t dims[2] = {size, 1};
+	{
+		h5_handle dataspace{H5Dget_space(*dataset), H5Sclose};
+		if(H5Sget_simple_extent_ndims(*dataspace) == 2) {
+			H5Sget_simple_extent_dims(*dataspace, dims, nullptr);
+			dims[0] = size / dims[1];
+		}
+	}
+
+	herr_t status = H5Dset_extent(*dataset, dims);
+	if(status < 0) {
+		throw iodump_exception{filename_, "H5Dset_extent"};
+	}
+}
+
+void iodump::group::remove(const std::string &name) const {
+	if(H5Ldelete(group_, name.c_str(), H5P_DEFAULT) < 0) {
+		throw iodump_exception{filename_, "H5Ldelete"};
+	}
+}
+
+void iodump::group::move(const std::string &from, const std::string &to) const {
+	if(H5Lmove(group_, from.c_str(), group_, to.c_str(), H5P_DEFAULT, H5P_DEFAULT) < 0) {
+		throw iodump_exception{filename_, "H5Lmove"};
+	}
+}
+
 bool iodump::group::exists(const std::string &path) const {
 	htri_t exists = H5Lexists(group_, path.c_str(), H5P_DEFAULT);
 	if(exists == 0) {
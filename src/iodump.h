@@ -1,8 +1,10 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <fmt/format.h>
 #include <hdf5.h>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -82,11 +84,59 @@ public:
 		template<class T>
 		void insert_back(const std::string &name, const std::vector<T> &data) const;
 
+		// like insert_back, but the dataset is two-dimensional with rows of row_length
+		// elements. data holds whole rows.
+		template<class T>
+		void insert_back_rows(const std::string &name, const std::vector<T> &data,
+		                      size_t row_length) const;
+
+		// shrinks a dataset created by insert_back or insert_back_rows to size elements.
+		void truncate(const std::string &name, size_t size) const;
+
+		// makes sure the dataset can hold size elements, or size/row_length rows if row_length is
+		// nonzero. Datasets that are created or extended here get room for twice that. Their
+		// storage is allocated right away and not compressed, so that write_at within the extent
+		// only changes the data and not the structure of the file.
+		template<class T>
+		void reserve(const std::string &name, size_t size, size_t row_length = 0) const;
+
+		// writes data into an existing dataset, starting at element first, or row first if it is
+		// two-dimensional. Then data holds whole rows.
+		template<class T>
+		void write_at(const std::string &name, const std::vector<T> &data, size_t first) const;
+
+		// removes the object name from the group. The file does not get smaller.
+		void remove(const std::string &name) const;
+		// renames the object from to to. to must not exist yet.
+		void move(const std::string &from, const std::string &to) const;
+
+		// write_row writes data into row number row of a two-dimensional dataset with row_count
+		// rows, creating it if necessary and widening it if data is longer than its rows. The
+		// rest of the row and everything that was never written holds fill_value.
+		template<class T>
+		void write_row(const std::string &name, const std::vector<T> &data, size_t row,
+		               size_t row_count, const T &fill_value) const;
+
+		// like write_row for a one-dimensional dataset with count elements.
+		template<class T>
+		void write_element(const std::string &name, const T &value, size_t idx, size_t count,
+		                   const T &fill_value) const;
+
 		template<class T>
 		void read(const std::string &name, std::vector<T> &data) const;
 		template<class T>
 		void read(const std::string &name, T &value) const;
 
+		// reads count elements starting at first, or count rows for two-dimensional datasets.
+		// Reading past the end gives fewer elements.
+		template<class T>
+		void read_range(const std::string &name, std::vector<T> &data, size_t first,
+		                size_t count) const;
+		// like read_range, but only reads the columns [column, column + width) of each row.
+		template<class T>
+		void read_columns(const std::string &name, std::vector<T> &data, size_t first,
+		                  size_t count, size_t column, size_t width) const;
+
 		size_t get_extent(const std::string &name) const;
 
 		group open_group(const std::string &path) const; // this works like the cd command
@@ -100,9 +150,19 @@ public:
 		// chunk_size == 0 means contiguous storage
 		// if the dataset already exists, we try to overwrite it. However it must have the same
 		// extent for that to work.
+		// row_length != 0 creates a two-dimensional dataset with size rows.
 		iodump::h5_handle create_dataset(const std::string &name, hid_t datatype, hsize_t size,
 		                                 hsize_t chunk_size, H5Z_filter_t compression_filter,
-		                                 bool unlimited) const;
+		                                 bool unlimited, hsize_t row_length = 0) const;
+
+		void reserve_dataset(const std::string &name, hid_t datatype, hsize_t size,
+		                     hsize_t row_length) const;
+
+		// opens or creates the dataset of write_row (rank 2) or write_element (rank 1) and
+		// returns it with its dimensions.
+		iodump::h5_handle open_table(const std::string &name, hid_t datatype, int rank,
+		                             hsize_t row_count, hsize_t row_length,
+		                             const void *fill_value, hsize_t *dims) const;
 	};
 
 	// delete what was there and create a new file for writing
@@ -111,8 +171,19 @@ public:
 	static iodump open_readonly(const std::string &filename);
 	static iodump open_readwrite(const std::string &filename);
 
+	// creates a file that only lives in memory. Use get_file_image to get its contents.
+	static iodump create_in_memory(const std::string &filename);
+
 	group get_root();
 
+	// returns the contents of the file as they would be on disk.
+	std::vector<char> get_file_image();
+
+	// Serial HDF5 is not thread-safe. Threads that may access files at the same time have to
+	// hold this lock. It is recursive so that functions that lock it can be called with the lock
+	// held.
+	static std::recursive_mutex &mutex();
+
 	// TODO: once the intel compiler can do guaranteed copy elision,
 	// please uncomment this line! and be careful about bugs!
 	// iodump(iodump &) = delete;
@@ -232,6 +303,141 @@ void iodump::group::insert_back(const std::string &name, const std::vector<T> &d
 		throw iodump_exception{filename_, "H5Dwrite"};
 }
 
+template<class T>
+void iodump::group::insert_back_rows(const std::string &name, const std::vector<T> &data,
+                                     size_t row_length) const {
+	assert(row_length > 0 && data.size() % row_length == 0);
+	if(!exists(name)) {
+		hsize_t chunk_rows = std::max<hsize_t>(1, chunk_size_ / row_length);
+		create_dataset(name, h5_datatype<T>(), 0, chunk_rows, compression_filter_, true,
+		               row_length);
+	}
+
+	h5_handle dataset{H5Dopen2(group_, name.c_str(), H5P_DEFAULT), H5Dclose};
+
+	hsize_t dims[2];
+	herr_t status;
+	{
+		h5_handle dataspace{H5Dget_space(*dataset), H5Sclose};
+		if(H5Sget_simple_extent_ndims(*dataspace) != 2) {
+			throw iodump_exception{filename_, fmt::format("{} is not two-dimensional", name)};
+		}
+		H5Sget_simple_extent_dims(*dataspace, dims, nullptr);
+		if(dims[1] != row_length) {
+			throw std::runtime_error{
+			    "iodump: tried to insert rows of a different length into an existing dataset!"};
+		}
+	}
+
+	hsize_t pos[2] = {dims[0], 0};
+	hsize_t extent[2] = {data.size() / row_length, row_length};
+	if(extent[0] == 0) {
+		return;
+	}
+
+	hsize_t new_dims[2] = {dims[0] + extent[0], row_length};
+	status = H5Dset_extent(*dataset, new_dims);
+	if(status < 0) {
+		throw iodump_exception{filename_, "H5Dset_extent"};
+	}
+
+	h5_handle memspace{H5Screate_simple(2, extent, nullptr), H5Sclose};
+	h5_handle dataspace{H5Dget_space(*dataset), H5Sclose};
+	status = H5Sselect_hyperslab(*dataspace, H5S_SELECT_SET, pos, nullptr, extent, nullptr);
+	if(status < 0)
+		throw iodump_exception{filename_, "H5Sselect_hyperslap"};
+
+	status = H5Dwrite(*dataset, h5_datatype<T>(), *memspace, *dataspace, H5P_DEFAULT, data.data());
+	if(status < 0)
+		throw iodump_exception{filename_, "H5Dwrite"};
+}
+
+template<class T>
+void iodump::group::reserve(const std::string &name, size_t size, size_t row_length) const {
+	reserve_dataset(name, h5_datatype<T>(), size, row_length);
+}
+
+template<class T>
+void iodump::group::write_at(const std::string &name, const std::vector<T> &data,
+                             size_t first) const {
+	h5_handle dataset{H5Dopen2(group_, name.c_str(), H5P_DEFAULT), H5Dclose};
+	h5_handle dataspace{H5Dget_space(*dataset), H5Sclose};
+
+	int rank = H5Sget_simple_extent_ndims(*dataspace);
+	if(rank < 1 || rank > 2)
+		throw iodump_exception{filename_, "H5Sget_simple_extent_ndims"};
+	hsize_t dims[2] = {0, 1};
+	H5Sget_simple_extent_dims(*dataspace, dims, nullptr);
+
+	hsize_t pos[2] = {first, 0};
+	hsize_t extent[2] = {data.size() / dims[1], dims[1]};
+	if(extent[0] == 0) {
+		return;
+	}
+	if(pos[0] + extent[0] > dims[0]) {
+		throw std::runtime_error{
+		    fmt::format("iodump: tried to write past the end of the dataset {}", name)};
+	}
+
+	herr_t status = H5Sselect_hyperslab(*dataspace, H5S_SELECT_SET, pos, nullptr, extent, nullptr);
+	if(status < 0)
+		throw iodump_exception{filename_, "H5Sselect_hyperslap"};
+
+	h5_handle memspace{H5Screate_simple(rank, extent, nullptr), H5Sclose};
+	status = H5Dwrite(*dataset, h5_datatype<T>(), *memspace, *dataspace, H5P_DEFAULT, data.data());
+	if(status < 0)
+		throw iodump_exception{filename_, "H5Dwrite"};
+}
+
+template<class T>
+void iodump::group::write_row(const std::string &name, const std::vector<T> &data, size_t row,
+                              size_t row_count, const T &fill_value) const {
+	assert(row < row_count);
+	hsize_t dims[2];
+	h5_handle dataset{open_table(name, h5_datatype<T>(), 2, row_count, data.size(), &fill_value,
+	                             dims)};
+	if(dims[1] == 0) {
+		return;
+	}
+
+	std::vector<T> padded = data;
+	padded.resize(dims[1], fill_value);
+
+	hsize_t pos[2] = {row, 0};
+	hsize_t extent[2] = {1, dims[1]};
+	h5_handle memspace{H5Screate_simple(2, extent, nullptr), H5Sclose};
+	h5_handle dataspace{H5Dget_space(*dataset), H5Sclose};
+	herr_t status = H5Sselect_hyperslab(*dataspace, H5S_SELECT_SET, pos, nullptr, extent, nullptr);
+	if(status < 0)
+		throw iodump_exception{filename_, "H5Sselect_hyperslap"};
+
+	status =
+	    H5Dwrite(*dataset, h5_datatype<T>(), *memspace, *dataspace, H5P_DEFAULT, padded.data());
+	if(status < 0)
+		throw iodump_exception{filename_, "H5Dwrite"};
+}
+
+template<class T>
+void iodump::group::write_element(const std::string &name, const T &value, size_t idx,
+                                  size_t count, const T &fill_value) const {
+	assert(idx < count);
+	hsize_t dims[2];
+	h5_handle dataset{open_table(name, h5_datatype<T>(), 1, count, 0, &fill_value, dims)};
+
+	hsize_t pos = idx;
+	hsize_t extent = 1;
+	h5_handle memspace{H5Screate_simple(1, &extent, nullptr), H5Sclose};
+	h5_handle dataspace{H5Dget_space(*dataset), H5Sclose};
+	herr_t status =
+	    H5Sselect_hyperslab(*dataspace, H5S_SELECT_SET, &pos, nullptr, &extent, nullptr);
+	if(status < 0)
+		throw iodump_exception{filename_, "H5Sselect_hyperslap"};
+
+	status = H5Dwrite(*dataset, h5_datatype<T>(), *memspace, *dataspace, H5P_DEFAULT, &value);
+	if(status < 0)
+		throw iodump_exception{filename_, "H5Dwrite"};
+}
+
 template<class T>
 void iodump::group::read(const std::string &name, std::vector<T> &data) const {
 	hid_t dset = H5Dopen2(group_, name.c_str(), H5P_DEFAULT);
@@ -257,6 +463,48 @@ void iodump::group::read(const std::string &name, std::vector<T> &data) const {
 	}
 }
 
+template<class T>
+void iodump::group::read_range(const std::string &name, std::vector<T> &data, size_t first,
+                               size_t count) const {
+	read_columns(name, data, first, count, 0, -1);
+}
+
+template<class T>
+void iodump::group::read_columns(const std::string &name, std::vector<T> &data, size_t first,
+                                 size_t count, size_t column, size_t width) const {
+	hid_t dset = H5Dopen2(group_, name.c_str(), H5P_DEFAULT);
+	if(dset < 0)
+		throw iodump_exception{filename_, fmt::format("H5Dopen2({})", name)};
+
+	h5_handle dataset{dset, H5Dclose};
+	h5_handle dataspace{H5Dget_space(*dataset), H5Sclose};
+
+	int rank = H5Sget_simple_extent_ndims(*dataspace);
+	if(rank < 1 || rank > 2)
+		throw iodump_exception{filename_, "H5Sget_simple_extent_ndims"};
+	hsize_t dims[2] = {0, 1};
+	H5Sget_simple_extent_dims(*dataspace, dims, nullptr);
+
+	hsize_t start[2] = {std::min<hsize_t>(first, dims[0]), std::min<hsize_t>(column, dims[1])};
+	hsize_t extent[2] = {std::min<hsize_t>(count, dims[0] - start[0]),
+	                     std::min<hsize_t>(width, dims[1] - start[1])};
+	data.resize(extent[0] * extent[1]);
+	if(data.empty()) {
+		return;
+	}
+
+	herr_t status =
+	    H5Sselect_hyperslab(*dataspace, H5S_SELECT_SET, start, nullptr, extent, nullptr);
+	if(status < 0)
+		throw iodump_exception{filename_, "H5Sselect_hyperslap"};
+
+	h5_handle memspace{H5Screate_simple(rank, extent, nullptr), H5Sclose};
+	status = H5Dread(*dataset, h5_datatype<T>(), *memspace, *dataspace, H5P_DEFAULT, data.data());
+	if(status < 0) {
+		throw iodump_exception{filename_, fmt::format("H5Dread({})", name)};
+	}
+}
+
 template<>
 inline void iodump::group::read(const std::string &name, std::string &value) const {
 	std::vector<char> buf;
@@ -1,15 +1,28 @@
 #include "jobinfo.h"
 #include "mc.h"
 #include "merger.h"
+#include <algorithm>
+#include <cmath>
+#include <csignal>
 #include <ctime>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <regex>
+#include <thread>
+#include <unistd.h>
 
 namespace loadl {
 
+static volatile std::sig_atomic_t stop_signal_ = 0;
+
+static void stop_signal_handler(int) {
+	stop_signal_ = 1;
+}
+
 // parses the duration '[[hours:]minutes:]seconds' into seconds
 // replace as soon as there is an alternative
 static int parse_duration(const std::string &str) {
@@ -76,6 +89,38 @@ jobinfo::jobinfo(const std::filesystem::path &jobfile_name, register_evalables_f
 
 	runtime = parse_duration(jobconfig.get<std::string>("mc_runtime"));
 	checkpoint_time = parse_duration(jobconfig.get<std::string>("mc_checkpoint_time"));
+	checkpoint_mtbf = parse_duration(jobconfig.get<std::string>("mc_checkpoint_mtbf", "0"));
+
+	if(jobconfig.get<bool>("mc_stop_on_signal", false)) {
+		std::signal(SIGTERM, stop_signal_handler);
+		std::signal(SIGUSR1, stop_signal_handler);
+	}
+}
+
+bool jobinfo::time_is_up(double elapsed, double shutdown_cost) const {
+	return stop_signal_ || elapsed + shutdown_cost > runtime;
+}
+
+bool jobinfo::stop_signal_received() {
+	return stop_signal_;
+}
+
+// Daly's higher-order estimate of the optimum checkpoint interval (Future Gener. Comp. Sy. 22,
+// 303 (2006)), which minimizes the expected time lost to checkpointing and recomputation.
+double jobinfo::checkpoint_interval(double checkpoint_cost) const {
+	if(checkpoint_mtbf <= 0 || checkpoint_cost <= 0) {
+		return checkpoint_time;
+	}
+
+	double interval = checkpoint_mtbf;
+	if(checkpoint_cost < 2 * checkpoint_mtbf) {
+		double ratio = checkpoint_cost / (2 * checkpoint_mtbf);
+		interval = sqrt(2 * checkpoint_cost * checkpoint_mtbf) *
+		               (1 + sqrt(ratio) / 3 + ratio / 9) -
+		           checkpoint_cost;
+	}
+
+	return std::clamp(interval, 0., checkpoint_time);
 }
 
 // This function lists files that could be run files being in the taskdir
@@ -91,6 +136,8 @@ std::vector<std::filesystem::path> jobinfo::list_run_files(const std::string &ta
 			results.emplace_back(p.path());
 		}
 	}
+	// the merge cache relies on the order staying the same.
+	std::sort(results.begin(), results.end());
 
 	return results;
 }
@@ -116,34 +163,169 @@ void jobinfo::concatenate_results() {
 	cat_results << "[";
 	for(size_t i = 0; i < task_names.size(); i++) {
 		std::ifstream res_file{taskdir(i) / "results.json"};
-		res_file.seekg(0, res_file.end);
-		size_t size = res_file.tellg();
-		res_file.seekg(0, res_file.beg);
-
-		std::vector<char> buf(size + 1, 0);
-		res_file.read(buf.data(), size);
-		cat_results << buf.data();
+		// tasks that were not merged yet are left out.
+		if(res_file.is_open()) {
+			cat_results << res_file.rdbuf();
+		}
 		if(i < task_names.size() - 1) {
 			cat_results << ",";
 		}
 		cat_results << "\n";
 	}
 	cat_results << "]\n";
+
+	write_results_hdf5(0, task_names.size());
 }
 
-void jobinfo::merge_task(int task_id) {
+void jobinfo::update_task_results(int task_id) {
+	write_results_hdf5(task_id, task_id + 1);
+}
+
+// The HDF5 results have a dataset for each quantity of each observable with one row per task.
+// Vector observables get a row as long as the longest vector, padded with NaN.
+void jobinfo::write_results_hdf5(size_t first_task, size_t last_task) {
+	std::filesystem::path filename = jobdir.parent_path() / fmt::format("{}.results.h5", jobname);
+	std::string joined_names;
+	for(const auto &task_name : task_names) {
+		joined_names += task_name + "\n";
+	}
+
+	std::lock_guard<std::recursive_mutex> lock{iodump::mutex()};
+
+	// a file for different tasks is started over.
+	std::vector<long long> result_times(task_names.size(), 0);
+	bool fresh = true;
+	if(std::filesystem::exists(filename)) {
+		try {
+			iodump file = iodump::open_readonly(filename);
+			auto root = file.get_root();
+			std::string file_names;
+			root.read("task_names", file_names);
+			root.read("result_times", result_times);
+			fresh = file_names != joined_names || result_times.size() != task_names.size();
+		} catch(const iodump_exception &e) {
+			// not a results file we can continue
+		}
+	}
+	if(fresh) {
+		result_times.assign(task_names.size(), 0);
+	}
+
+	iodump file = fresh ? iodump::create(filename) : iodump::open_readwrite(filename);
+	auto root = file.get_root();
+	if(fresh) {
+		root.write("task_names", joined_names);
+	}
+	auto obs_group = root.open_group("observables");
+
+	size_t task_count = task_names.size();
+	const double nan = std::numeric_limits<double>::quiet_NaN();
+	for(size_t i = first_task; i < last_task; i++) {
+		std::filesystem::path task_filename = taskdir(i) / "results.h5";
+		long long time = 0;
+		if(std::filesystem::exists(task_filename)) {
+			time = std::filesystem::last_write_time(task_filename).time_since_epoch().count();
+		}
+		if(time == result_times[i]) {
+			continue;
+		}
+
+		std::string params;
+		results res;
+		if(time != 0) {
+			res = results::read_hdf5(task_filename, params);
+		}
+		root.write_row("parameters", std::vector<char>{params.begin(), params.end()}, i,
+		               task_count, '\0');
+
+		// observables the task does not have (anymore) get empty rows.
+		std::vector<std::string> obs_names;
+		for(const auto &obs_name : obs_group) {
+			obs_names.push_back(obs_name);
+		}
+		for(const auto &[obs_name, obs] : res.observables) {
+			obs_names.push_back(obs_name);
+		}
+		std::sort(obs_names.begin(), obs_names.end());
+		obs_names.erase(std::unique(obs_names.begin(), obs_names.end()), obs_names.end());
+
+		for(const auto &obs_name : obs_names) {
+			observable_result empty;
+			auto it = res.observables.find(obs_name);
+			const auto &obs = it == res.observables.end() ? empty : it->second;
+
+			auto g = obs_group.open_group(obs_name);
+			size_t zero = 0;
+			g.write_element("vector_length", obs.mean.size(), i, task_count, zero);
+			g.write_element("rebinning_bin_length", obs.rebinning_bin_length, i, task_count,
+			                zero);
+			g.write_element("rebinning_bin_count", obs.rebinning_bin_count, i, task_count, zero);
+			g.write_element("internal_bin_length", obs.internal_bin_length, i, task_count,
+			                zero);
+			g.write_row("mean", obs.mean, i, task_count, nan);
+			g.write_row("error", obs.error, i, task_count, nan);
+			g.write_row("autocorrelation_time", obs.autocorrelation_time, i, task_count, nan);
+		}
+
+		root.write_element("result_times", time, i, task_count, 0LL);
+	}
+}
+
+void jobinfo::merge_task(int task_id, unsigned threads, MPI_Comm comm) {
 	std::vector<std::filesystem::path> meas_files = list_run_files(taskdir(task_id), "meas\\.h5");
 	size_t rebinning_bin_length = jobfile["jobconfig"].get<size_t>("merge_rebin_length", 0);
 	size_t sample_skip = jobfile["jobconfig"].get<size_t>("merge_sample_skip", 0);
-	results results = merge(meas_files, rebinning_bin_length, sample_skip);
+	bool fft_autocorrelation = jobfile["jobconfig"].get<bool>("merge_fft_autocorrelation", false);
 
-	evaluator eval{results};
+	std::filesystem::path result_filename = taskdir(task_id) / "results.json";
+	std::filesystem::path hdf5_result_filename = taskdir(task_id) / "results.h5";
+	std::filesystem::path cache_filename;
+	if(jobfile["jobconfig"].get<bool>("merge_cache", false)) {
+		cache_filename = taskdir(task_id) / "merge_cache.h5";
+		if(std::filesystem::exists(result_filename) &&
+		   std::filesystem::exists(hdf5_result_filename) &&
+		   merge_cache_is_current(cache_filename, meas_files, rebinning_bin_length, sample_skip,
+		                          fft_autocorrelation)) {
+			return;
+		}
+	}
+	results results = merge(meas_files, rebinning_bin_length, sample_skip, threads, comm,
+	                        cache_filename, fft_autocorrelation);
+
+	int rank = 0;
+	if(comm != MPI_COMM_NULL) {
+		MPI_Comm_rank(comm, &rank);
+	}
+	if(rank != 0) {
+		return;
+	}
+
+	// evalable functions are only called from several threads if the user says they can be.
+	// That includes tasks that are merged at the same time.
+	unsigned evalable_threads = jobfile["jobconfig"].get<unsigned>("evalable_threads", 1);
+	if(evalable_threads == 0) {
+		evalable_threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	static std::mutex evalable_mutex;
+	std::unique_lock<std::mutex> evalable_lock{evalable_mutex, std::defer_lock};
+	if(evalable_threads == 1) {
+		evalable_lock.lock();
+	}
+	evaluator eval{results, evalable_threads};
 	evalable_func_(eval, jobfile["tasks"][task_names[task_id]]);
 	eval.append_results();
 
-	std::filesystem::path result_filename = taskdir(task_id) / "results.json";
 	const std::string &task_name = task_names.at(task_id);
 	results.write_json(result_filename, taskdir(task_id), jobfile["tasks"][task_name].get_json());
+
+	// the job results are built from this file, possibly by another process.
+	std::filesystem::path tmp_filename =
+	    fmt::format("{}.{}.tmp", hdf5_result_filename.string(), getpid());
+	{
+		std::lock_guard<std::recursive_mutex> lock{iodump::mutex()};
+		results.write_hdf5(tmp_filename, jobfile["tasks"][task_name].get_json());
+	}
+	std::filesystem::rename(tmp_filename, hdf5_result_filename);
 }
 
 void jobinfo::log(const std::string &message) {
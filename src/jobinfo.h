@@ -4,6 +4,7 @@
 #include "iodump.h"
 #include "parser.h"
 #include <filesystem>
+#include <mpi.h>
 #include <string>
 #include <vector>
 
@@ -23,6 +24,9 @@ public:
 	std::vector<std::string> task_names;
 
 	double checkpoint_time{};
+	// mean time between failures or preemptions. If it is set, the checkpoint interval adapts
+	// to the measured checkpoint cost and checkpoint_time is only its upper limit.
+	double checkpoint_mtbf{};
 	double runtime{};
 
 	jobinfo(const std::filesystem::path &jobfile_name, register_evalables_func evalable_func);
@@ -30,12 +34,34 @@ public:
 	std::filesystem::path rundir(int task_id, int run_id) const;
 	std::filesystem::path taskdir(int task_id) const;
 
+	// time between checkpoints that take checkpoint_cost seconds to write. A checkpoint_cost of 0
+	// means it has not been measured yet and gives the maximum interval.
+	double checkpoint_interval(double checkpoint_cost) const;
+
+	// true if the runner should stop after elapsed seconds when it still needs shutdown_cost
+	// seconds to write its last checkpoint and merge.
+	bool time_is_up(double elapsed, double shutdown_cost) const;
+
+	// set by SIGTERM or SIGUSR1 if mc_stop_on_signal is enabled.
+	static bool stop_signal_received();
+
 	static std::vector<std::filesystem::path> list_run_files(const std::string &taskdir,
 	                                                         const std::string &file_ending);
 	size_t read_dump_progress(int task_id) const;
-	void merge_task(int task_id);
+	// threads are used to merge the observables in parallel. If comm is given, its ranks share
+	// the work and rank 0 writes the results.
+	void merge_task(int task_id, unsigned threads = 1, MPI_Comm comm = MPI_COMM_NULL);
+	// writes jobname.results.json and jobname.results.h5 from the results of the tasks. The
+	// HDF5 file is only updated for tasks whose results changed since. This should only be done
+	// by one rank.
 	void concatenate_results();
+	// updates the row of one task in jobname.results.h5.
+	void update_task_results(int task_id);
 	void log(const std::string &message);
+
+private:
+	// updates the rows of the tasks [first_task, last_task) in jobname.results.h5.
+	void write_results_hdf5(size_t first_task, size_t last_task);
 };
 
 }
@@ -4,31 +4,127 @@
 #include "merger.h"
 #include "runner.h"
 #include "runner_single.h"
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
 namespace loadl {
 
-inline int merge_only(jobinfo job, const mc_factory &, int, char **) {
+// the part of merge_only that one rank does.
+inline void merge_only_rank(jobinfo &job, int rank, int size) {
 	int ntasks = job.task_names.size();
 	int len = log(ntasks) / log(10) + 1;
 	size_t max_tasklen = 0;
 
-	for(size_t task_id = 0; task_id < job.task_names.size(); task_id++) {
-		std::string taskdir = job.taskdir(task_id);
-		max_tasklen = std::max(max_tasklen, taskdir.size());
+	int groups = std::max(1, std::min(size, ntasks));
+	MPI_Comm group_comm;
+	MPI_Comm_split(MPI_COMM_WORLD, rank % groups, rank, &group_comm);
+	int group_size;
+	MPI_Comm_size(group_comm, &group_size);
+	// a rank that has a task to itself does not need MPI to merge it.
+	MPI_Comm task_comm = group_size > 1 ? group_comm : MPI_COMM_NULL;
 
-		std::cout << fmt::format("\rMerging task {0: >{3}}/{1: >{3}}... {2: <{4}}", task_id + 1,
-		                         job.task_names.size(), taskdir, len, max_tasklen);
-		std::cout.flush();
+	std::vector<int> tasks;
+	for(int task_id = rank % groups; task_id < ntasks; task_id += groups) {
+		tasks.push_back(task_id);
+	}
+
+	unsigned threads = job.jobfile["jobconfig"].get<unsigned>("merge_threads", 1);
+	if(threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	// with MPI, the tasks are merged one after another.
+	unsigned task_threads = 1;
+	if(task_comm == MPI_COMM_NULL) {
+		task_threads = std::max<size_t>(1, std::min<size_t>(threads, tasks.size()));
+	}
+	unsigned merge_threads = std::max(1u, threads / task_threads);
+
+	std::mutex progress_mutex;
+	std::atomic<size_t> next_task{0};
+	auto merge_tasks = [&](jobinfo job) {
+		for(size_t i = next_task++; i < tasks.size(); i = next_task++) {
+			int task_id = tasks[i];
+			if(rank == 0) {
+				std::lock_guard<std::mutex> lock{progress_mutex};
+				std::string taskdir = job.taskdir(task_id);
+				max_tasklen = std::max(max_tasklen, taskdir.size());
+
+				std::cout << fmt::format("\rMerging task {0: >{3}}/{1: >{3}}... {2: <{4}}",
+				                         task_id + 1, ntasks, taskdir, len, max_tasklen);
+				std::cout.flush();
+			}
+
+			job.merge_task(task_id, merge_threads, task_comm);
+		}
+	};
+
+	// MPI is only called from the main thread, so a task that is shared with other ranks is
+	// merged there.
+	if(task_threads == 1) {
+		merge_tasks(job);
+	} else {
+		// every thread gets its own copy of the jobinfo.
+		std::vector<std::thread> workers;
+		std::vector<std::exception_ptr> errors(task_threads);
+		for(unsigned i = 0; i < task_threads; i++) {
+			workers.emplace_back([&, i]() {
+				try {
+					merge_tasks(job);
+				} catch(...) {
+					errors[i] = std::current_exception();
+				}
+			});
+		}
+		for(auto &worker : workers) {
+			worker.join();
+		}
+		for(auto &error : errors) {
+			if(error) {
+				std::rethrow_exception(error);
+			}
+		}
+	}
+
+	MPI_Barrier(MPI_COMM_WORLD);
+	if(rank == 0) {
+		job.concatenate_results();
+		std::cout << fmt::format("\rMerged {0} tasks.{1: >{2}}\n", job.task_names.size(), "",
+		                         2 * len + 5 + max_tasklen);
+	}
+
+	MPI_Comm_free(&group_comm);
+}
+
+// merge_only can also run under mpirun. The ranks then take turns on the tasks. If there are more
+// ranks than tasks, the ranks that share a task split its observables. The jobconfig option
+// merge_threads sets the number of threads per rank (0 means all cores). They work on different
+// tasks, or on the observables of one task if there are more threads than tasks.
+inline int merge_only(jobinfo job, const mc_factory &, int argc, char **argv) {
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 
-		job.merge_task(task_id);
+	int rank, size;
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+	// the other ranks would wait for this one forever.
+	try {
+		if(provided < MPI_THREAD_FUNNELED) {
+			throw std::runtime_error{"the MPI library does not support MPI_THREAD_FUNNELED"};
+		}
+		merge_only_rank(job, rank, size);
+	} catch(const std::exception &e) {
+		std::cerr << fmt::format("merge: rank {} failed: {}\n", rank, e.what());
+		MPI_Abort(MPI_COMM_WORLD, 1);
 	}
-	std::cout << fmt::format("\rMerged {0} tasks.{1: >{2}}\n", job.task_names.size(), "",
-	                         2 * len + 5 + max_tasklen);
+	MPI_Finalize();
 
 	return 0;
 }
 
+// The starters write the job results themselves, on one rank.
 template<typename mc_implementation>
 int run_mc(int (*starter)(jobinfo job, const mc_factory &, int argc, char **argv), int argc,
            char **argv) {
@@ -51,10 +147,7 @@ int run_mc(int (*starter)(jobinfo job, const mc_factory &, int argc, char **argv
 	// a writing lock by reading some measurement files.
 	setenv("HDF5_USE_FILE_LOCKING", "FALSE", 1);
 
-	int rc = starter(job, mccreator, argc, argv);
-
-	job.concatenate_results();
-	return rc;
+	return starter(job, mccreator, argc, argv);
 }
 
 // run this function from main() in your code.
@@ -1,11 +1,29 @@
 #include "mc.h"
 #include <filesystem>
+#include <fstream>
+#include <iostream>
 
 namespace loadl {
 
-mc::mc(const parser &p) : param{p}, measure{p.get<size_t>("binsize")} {
+// measurement_buffer_size is given in MiB.
+static size_t measurement_buffer_limit(const parser &p) {
+	return p.get<double>("measurement_buffer_size", 0) * (1 << 20);
+}
+
+mc::mc(const parser &p)
+    : param{p}, measure{p.get<size_t>("binsize"), measurement_buffer_limit(p),
+                        p.get<bool>("packed_measurements", false)} {
 	therm_ = p.get<int>("thermalization");
 	pt_sweeps_per_global_update_ = p.get<int>("pt_sweeps_per_global_update", 1);
+	max_bins_ = p.get<size_t>("max_bins", 0);
+	sweep_time_ = measure.get_handle<double>("_ll_sweep_time");
+	measurement_time_ = measure.get_handle<double>("_ll_measurement_time");
+}
+
+mc::~mc() {
+	if(dump_writer_.joinable()) {
+		dump_writer_.join();
+	}
 }
 
 void mc::write_output(const std::string &) {}
@@ -14,6 +32,10 @@ size_t mc::sweep() const {
 	return sweep_;
 }
 
+double mc::checkpoint_write_time() const {
+	return checkpoint_write_time_;
+}
+
 void mc::_init() {
 	// simple profiling support: measure the time spent for sweeps/measurements etc
 	measure.register_observable("_ll_checkpoint_read_time", 1);
@@ -38,7 +60,15 @@ void mc::_do_measurement() {
 
 	double measurement_time =
 	    (tend.tv_sec - tstart.tv_sec) + 1e-9 * (tend.tv_nsec - tstart.tv_nsec);
-	measure.add("_ll_measurement_time", measurement_time);
+	measurement_time_.add(measurement_time);
+
+	// The dump still has the old extent of the measurement file, so samples flushed here are
+	// dropped again if we crash before the next checkpoint. In parallel tempering mode, the
+	// buffers are exchanged between ranks and have to stay in memory.
+	if(!pt_mode_ && !rundir_.empty() && measure.buffer_full()) {
+		std::lock_guard<std::recursive_mutex> lock{iodump::mutex()};
+		measurements_write(rundir_);
+	}
 }
 
 void mc::_do_update() {
@@ -51,7 +81,7 @@ void mc::_do_update() {
 
 	double sweep_time = (tend.tv_sec - tstart.tv_sec) + 1e-9 * (tend.tv_nsec - tstart.tv_nsec);
 	if(is_thermalized()) {
-		measure.add("_ll_sweep_time", sweep_time);
+		sweep_time_.add(sweep_time);
 	}
 }
 
@@ -65,54 +95,147 @@ double mc::_pt_weight_ratio(const std::string &param_name, double new_param) {
 	return wr;
 }
 
+void mc::measurements_write(const std::string &dir) {
+	// the buffers of parallel tempering runs are exchanged, so they need a common bin length.
+	size_t max_bins = pt_mode_ ? 0 : max_bins_;
+	std::string filename = dir + ".meas.h5";
+
+	// If the new samples fit into the room the file has, they are written in place. That only
+	// changes data that the dump does not count yet, so a crash before _write_finalize is undone
+	// by _read. Anything that changes the structure of the file is done on a copy.
+	bool fits = false;
+	if(std::filesystem::exists(filename)) {
+		iodump meas_file = iodump::open_readonly(filename);
+		fits = measure.samples_fit(meas_file.get_root(), max_bins);
+	}
+	if(fits) {
+		iodump meas_file = iodump::open_readwrite(filename);
+		measure.samples_write(meas_file.get_root(), max_bins);
+		return;
+	}
+
+	std::string tmp_filename = filename + ".tmp";
+	if(std::filesystem::exists(filename)) {
+		std::filesystem::copy_file(filename, tmp_filename,
+		                           std::filesystem::copy_options::overwrite_existing);
+	} else {
+		std::filesystem::remove(tmp_filename);
+	}
+	{
+		iodump meas_file = iodump::open_readwrite(tmp_filename);
+		measure.samples_write(meas_file.get_root(), max_bins);
+	}
+	std::filesystem::rename(tmp_filename, filename);
+}
+
+void mc::meas_file_truncate(const std::string &dir) {
+	try {
+		iodump meas_file = iodump::open_readwrite(dir + ".meas.h5");
+		measure.samples_truncate(meas_file.get_root());
+	} catch(const iodump_exception &e) {
+		throw std::runtime_error{fmt::format(
+		    "{}.meas.h5 cannot be read and does not fit the checkpoint in {}.dump.h5: {}", dir,
+		    dir, e.what())};
+	}
+}
+
+void mc::dump_write(const iodump::group &g) {
+	rng->checkpoint_write(g.open_group("random_number_generator"));
+	checkpoint_write(g.open_group("simulation"));
+	measure.checkpoint_write(g.open_group("measurements"));
+
+	size_t therm = therm_;
+	if(pt_mode_) {
+		therm *= pt_sweeps_per_global_update_;
+	}
+	g.write("thermalization_sweeps", std::min(sweep_, therm));
+	g.write("sweeps", sweep_ - std::min(sweep_, therm));
+	// the current checkpoint is not done yet, so this is the duration of the one before.
+	g.write("checkpoint_write_time", checkpoint_write_time_);
+}
+
 void mc::_write(const std::string &dir) {
 	struct timespec tstart, tend;
 	clock_gettime(CLOCK_MONOTONIC_RAW, &tstart);
 
+	measurements_write(dir);
+
 	// blocks limit scopes of the dump file handles to ensure they are closed at the right time.
 	{
-		std::error_code ec;
-		std::filesystem::copy_file(dir + ".meas.h5", dir + ".meas.h5.tmp",
-		                           std::filesystem::copy_options::overwrite_existing, ec);
-		if(ec && ec != std::errc::no_such_file_or_directory) {
-			throw std::system_error(ec);
-		}
-		iodump meas_file = iodump::open_readwrite(dir + ".meas.h5.tmp");
-		auto g = meas_file.get_root();
-		measure.samples_write(g);
+		iodump dump_file = iodump::create(dir + ".dump.h5.tmp");
+		dump_write(dump_file.get_root());
 	}
 
-	{
-		iodump dump_file = iodump::create(dir + ".dump.h5.tmp");
-		auto g = dump_file.get_root();
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tend);
+	checkpoint_write_time_ = (tend.tv_sec - tstart.tv_sec) + 1e-9 * (tend.tv_nsec - tstart.tv_nsec);
+	measure.add("_ll_checkpoint_write_time", checkpoint_write_time_);
+}
 
-		rng->checkpoint_write(g.open_group("random_number_generator"));
-		checkpoint_write(g.open_group("simulation"));
-		measure.checkpoint_write(g.open_group("measurements"));
+void mc::_write_async(const std::string &dir) {
+	struct timespec tstart, tend;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tstart);
 
-		size_t therm = therm_;
-		if(pt_mode_) {
-			therm *= pt_sweeps_per_global_update_;
-		}
-		g.write("thermalization_sweeps", std::min(sweep_, therm));
-		g.write("sweeps", sweep_ - std::min(sweep_, therm));
+	if(dump_writer_.joinable()) {
+		throw std::runtime_error{"mc::_write_async: previous checkpoint was not finalized"};
 	}
 
+	measurements_write(dir);
+
+	std::vector<char> image;
+	{
+		iodump dump_file = iodump::create_in_memory(dir + ".dump.h5.tmp");
+		dump_write(dump_file.get_root());
+		image = dump_file.get_file_image();
+	}
+
+	// no HDF5 calls from here on, so this is safe without a thread-safe HDF5. The dump is
+	// finalized as soon as it is on disk, so a crash afterwards loses nothing before it.
+	dump_writer_ = std::thread{[this, image = std::move(image), dir]() {
+		std::string filename = dir + ".dump.h5.tmp";
+		try {
+			std::ofstream file{filename, std::ios::binary | std::ios::trunc};
+			file.write(image.data(), image.size());
+			file.close();
+			if(!file) {
+				throw std::runtime_error{fmt::format("could not write '{}'", filename)};
+			}
+			std::filesystem::rename(filename, dir + ".dump.h5");
+		} catch(...) {
+			dump_writer_error_ = std::current_exception();
+		}
+	}};
+
 	clock_gettime(CLOCK_MONOTONIC_RAW, &tend);
-	double checkpoint_write_time =
-	    (tend.tv_sec - tstart.tv_sec) + 1e-9 * (tend.tv_nsec - tstart.tv_nsec);
-	measure.add("_ll_checkpoint_write_time", checkpoint_write_time);
+	checkpoint_write_time_ = (tend.tv_sec - tstart.tv_sec) + 1e-9 * (tend.tv_nsec - tstart.tv_nsec);
+	measure.add("_ll_checkpoint_write_time", checkpoint_write_time_);
 }
 
 // This function is called if it is certain that the *.tmp files have been completely written.
 // Important for parallel tempering mode where all slaves in a chain have to write consistent dumps.
+// After _write_async, the background thread has already renamed the dump, so this only waits for
+// it.
 void mc::_write_finalize(const std::string &dir) {
+	if(dump_writer_.joinable()) {
+		dump_writer_.join();
+		if(dump_writer_error_) {
+			std::rethrow_exception(std::exchange(dump_writer_error_, nullptr));
+		}
+		return;
+	}
 	std::filesystem::rename(dir + ".dump.h5.tmp", dir + ".dump.h5");
-	std::filesystem::rename(dir + ".meas.h5.tmp", dir + ".meas.h5");
 }
 
 bool mc::_read(const std::string &dir) {
+	rundir_ = dir;
 	if(!std::filesystem::exists(dir + ".dump.h5")) {
+		// samples written before the first checkpoint are not accounted for by any dump. Without
+		// a dump, all observables have an extent of zero, so they are all dropped.
+		if(std::filesystem::exists(dir + ".meas.h5")) {
+			std::cerr << fmt::format(
+			    "{}.meas.h5 has no dump to go with it. Dropping its samples and starting over.\n",
+			    dir);
+			meas_file_truncate(dir);
+		}
 		return false;
 	}
 
@@ -127,10 +250,17 @@ bool mc::_read(const std::string &dir) {
 	measure.checkpoint_read(g.open_group("measurements"));
 	checkpoint_read(g.open_group("simulation"));
 
+	// without a measurement file, the checkpoint has to expect no samples.
+	meas_file_truncate(dir);
+
 	size_t sweeps, therm_sweeps;
 	g.read("thermalization_sweeps", therm_sweeps);
 	g.read("sweeps", sweeps);
 	sweep_ = sweeps + therm_sweeps;
+	// dumps of older versions do not have it.
+	if(g.exists("checkpoint_write_time")) {
+		g.read("checkpoint_write_time", checkpoint_write_time_);
+	}
 
 	clock_gettime(CLOCK_MONOTONIC_RAW, &tend);
 	measure.add("_ll_checkpoint_read_time",
@@ -4,8 +4,10 @@
 #include "measurements.h"
 #include "parser.h"
 #include "random.h"
+#include <exception>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace loadl {
@@ -15,6 +17,21 @@ private:
 	size_t sweep_{0};
 	size_t therm_{0};
 	int pt_sweeps_per_global_update_{-1};
+	size_t max_bins_{0}; // adaptive binning: bin lengths double beyond this many bins
+
+	std::string rundir_; // set by _read, needed to flush full measurement buffers
+	double checkpoint_write_time_{0}; // duration of the last checkpoint, kept in the dump
+	observable_handle<double> sweep_time_;
+	observable_handle<double> measurement_time_;
+
+	// writes the dump file image of the last _write_async in the background
+	std::thread dump_writer_;
+	std::exception_ptr dump_writer_error_;
+
+	void measurements_write(const std::string &dir);
+	// drops the samples that the checkpoint does not know about and throws if some are missing.
+	void meas_file_truncate(const std::string &dir);
+	void dump_write(const iodump::group &dump_file);
 
 protected:
 	parser param;
@@ -41,6 +58,9 @@ public:
 	bool pt_mode_{};
 
 	size_t sweep() const;
+	// how long the last checkpoint took to write, also if it was written by a previous job.
+	// 0 if that is not known.
+	double checkpoint_write_time() const;
 
 	// implement this static function in your class!
 	// static void register_evalables(evaluator &evalables);
@@ -52,6 +72,10 @@ public:
 	void _init();
 
 	void _write(const std::string &dir);
+	// Like _write, but the dump is only serialized into memory and written to disk by a
+	// background thread, so the simulation can continue right away. The thread renames the dump
+	// once it is written. _write_finalize waits for it.
+	void _write_async(const std::string &dir);
 	void _write_finalize(const std::string &dir);
 	bool _read(const std::string &dir);
 
@@ -64,7 +88,7 @@ public:
 	measurements measure;
 
 	mc(const parser &p);
-	virtual ~mc() = default;
+	virtual ~mc();
 };
 
 typedef std::function<mc *(const parser &)> mc_factory;
@@ -1,9 +1,64 @@
 #include "measurements.h"
+#include <algorithm>
 #include <fmt/format.h>
 #include <mpi.h>
+#include <tuple>
 namespace loadl {
 
-measurements::measurements(size_t default_bin_size) : default_bin_size_{default_bin_size} {}
+size_t observable_pack::row_length() const {
+	size_t length = 0;
+	for(auto vector_length : vector_lengths) {
+		length += vector_length;
+	}
+	return length;
+}
+
+// '/' cannot appear in observable names.
+static std::string join_names(const std::vector<std::string> &names) {
+	std::string joined_names;
+	for(const auto &name : names) {
+		joined_names += (joined_names.empty() ? "" : "/") + name;
+	}
+	return joined_names;
+}
+
+static std::vector<std::string> split_names(const std::string &joined_names) {
+	std::vector<std::string> names;
+	size_t pos = 0;
+	while(pos <= joined_names.size()) {
+		size_t end = std::min(joined_names.find('/', pos), joined_names.size());
+		names.push_back(joined_names.substr(pos, end - pos));
+		pos = end + 1;
+	}
+	return names;
+}
+
+void observable_pack::write(const iodump::group &pack) const {
+	pack.write("names", join_names(names));
+	pack.write("vector_lengths", vector_lengths);
+	pack.write("bin_length", bin_length);
+}
+
+observable_pack observable_pack::read(const iodump::group &pack) {
+	observable_pack p;
+	std::string joined_names;
+	pack.read("names", joined_names);
+	pack.read("vector_lengths", p.vector_lengths);
+	pack.read("bin_length", p.bin_length);
+	p.names = split_names(joined_names);
+
+	if(p.names.size() != p.vector_lengths.size()) {
+		throw std::runtime_error{"observable_pack: names and vector_lengths do not match"};
+	}
+	return p;
+}
+
+bool observable_pack::has_left(const iodump::group &meas_file, const std::string &name) {
+	return meas_file.exists(name) && meas_file.open_group(name).exists("samples");
+}
+
+measurements::measurements(size_t default_bin_size, size_t buffer_limit, bool packed)
+    : default_bin_size_{default_bin_size}, buffer_limit_{buffer_limit}, packed_{packed} {}
 
 bool measurements::observable_name_is_legal(const std::string &obs_name) {
 	if(obs_name.find('/') != obs_name.npos) {
@@ -25,27 +80,387 @@ void measurements::register_observable(const std::string &name, size_t bin_size)
 		throw std::runtime_error(fmt::format("Observable '{}' already exists.", name));
 	}
 
-	observables_.emplace(name, observable{name, bin_size, 0});
+	auto [it, inserted] = observables_.emplace(name, observable{name, bin_size, 0});
+	(void)inserted;
+	it->second.track_buffered_bytes(&buffered_bytes_);
 }
 
 void measurements::checkpoint_write(const iodump::group &dump_file) {
+	if(packed_) {
+		packed_checkpoint_write(dump_file.open_group(observable_pack::group_name));
+		return;
+	}
+
 	for(const auto &obs : observables_) {
 		obs.second.checkpoint_write(dump_file.open_group(obs.first));
 	}
 }
 
+// every field of the observables' checkpoint_state becomes one dataset with an entry for each.
+void measurements::packed_checkpoint_write(const iodump::group &dump_file) const {
+	std::vector<std::string> names;
+	std::vector<size_t> vector_lengths, bin_lengths, current_bin_fillings, meas_file_extents;
+	std::vector<double> samples;
+	for(const auto &[name, obs] : observables_) {
+		auto state = obs.get_checkpoint_state();
+		names.push_back(name);
+		vector_lengths.push_back(state.vector_length);
+		bin_lengths.push_back(state.bin_length);
+		current_bin_fillings.push_back(state.current_bin_filling);
+		meas_file_extents.push_back(state.meas_file_extent);
+		samples.insert(samples.end(), state.samples.begin(), state.samples.end());
+	}
+
+	dump_file.write("names", join_names(names));
+	dump_file.write("vector_lengths", vector_lengths);
+	dump_file.write("bin_lengths", bin_lengths);
+	dump_file.write("current_bin_fillings", current_bin_fillings);
+	dump_file.write("meas_file_extents", meas_file_extents);
+	dump_file.write("samples", samples);
+}
+
+void measurements::packed_checkpoint_read(const iodump::group &dump_file) {
+	std::string joined_names;
+	std::vector<size_t> vector_lengths, bin_lengths, current_bin_fillings, meas_file_extents;
+	std::vector<double> samples;
+	dump_file.read("names", joined_names);
+	dump_file.read("vector_lengths", vector_lengths);
+	dump_file.read("bin_lengths", bin_lengths);
+	dump_file.read("current_bin_fillings", current_bin_fillings);
+	dump_file.read("meas_file_extents", meas_file_extents);
+	dump_file.read("samples", samples);
+
+	auto names = joined_names.empty() ? std::vector<std::string>{} : split_names(joined_names);
+	size_t total_length = 0;
+	for(auto vector_length : vector_lengths) {
+		total_length += vector_length;
+	}
+	if(names.size() != vector_lengths.size() || bin_lengths.size() != names.size() ||
+	   current_bin_fillings.size() != names.size() || meas_file_extents.size() != names.size() ||
+	   samples.size() != total_length) {
+		throw std::runtime_error{"measurements: the packed checkpoint does not fit together"};
+	}
+
+	size_t offset = 0;
+	for(size_t i = 0; i < names.size(); i++) {
+		observable::checkpoint_state state{
+		    vector_lengths[i], bin_lengths[i], current_bin_fillings[i], meas_file_extents[i],
+		    std::vector<double>(samples.begin() + offset,
+		                        samples.begin() + offset + vector_lengths[i])};
+		offset += vector_lengths[i];
+		observables_.insert_or_assign(names[i], observable::checkpoint_read(names[i], state));
+	}
+}
+
 void measurements::checkpoint_read(const iodump::group &dump_file) {
+	// observables that already exist are overwritten in place so that their handles stay valid.
+	// Checkpoints can be packed or not, whatever packed_ says now.
 	for(const auto &obs_name : dump_file) {
-		observables_.emplace(obs_name,
-		                     observable::checkpoint_read(obs_name, dump_file.open_group(obs_name)));
+		if(obs_name == observable_pack::group_name) {
+			packed_checkpoint_read(dump_file.open_group(obs_name));
+			continue;
+		}
+		observables_.insert_or_assign(
+		    obs_name, observable::checkpoint_read(obs_name, dump_file.open_group(obs_name)));
+	}
+
+	buffered_bytes_ = 0;
+	for(auto &[name, obs] : observables_) {
+		(void)name;
+		obs.track_buffered_bytes(&buffered_bytes_);
 	}
 }
 
-void measurements::samples_write(const iodump::group &meas_file) {
+void measurements::samples_write(const iodump::group &meas_file, size_t max_bins) {
+	std::set<std::string> packed;
+	if(packed_) {
+		packed = packed_samples_write(meas_file);
+	}
+
 	for(auto &obs : observables_) {
+		if(packed.count(obs.first) > 0) {
+			continue;
+		}
 		auto g = meas_file.open_group(obs.first);
-		obs.second.measurement_write(g);
+		obs.second.measurement_write(g, max_bins);
+	}
+}
+
+bool measurements::samples_fit(const iodump::group &meas_file, size_t max_bins) const {
+	std::set<std::string> packed;
+	if(packed_ && meas_file.exists(observable_pack::group_name)) {
+		auto packs = meas_file.open_group(observable_pack::group_name);
+		for(const auto &pack_name : packs) {
+			auto pack_group = packs.open_group(pack_name);
+			auto pack = observable_pack::read(pack_group);
+			std::vector<pack_member> members;
+			size_t rows = pack_rows(meas_file, pack, members);
+			if(!observable::file_samples_fit(pack_group, rows * pack.row_length())) {
+				return false;
+			}
+			for(size_t i = 0; i < members.size(); i++) {
+				if(members[i] == pack_member::leaving) {
+					return false;
+				}
+				if(members[i] == pack_member::staying) {
+					packed.insert(pack.names[i]);
+				}
+			}
+		}
+	}
+
+	// anything else that is not in the file yet needs a new group or pack.
+	for(const auto &[name, obs] : observables_) {
+		if(packed.count(name) > 0) {
+			continue;
+		}
+		if(!meas_file.exists(name)) {
+			if(packed_ && obs.vector_length() == 0) {
+				continue;
+			}
+			return false;
+		}
+		if(!obs.measurement_fits(meas_file.open_group(name), max_bins)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+std::set<std::string> measurements::packed_samples_write(const iodump::group &meas_file) {
+	std::set<std::string> handled;
+	auto packs = meas_file.open_group(observable_pack::group_name);
+
+	size_t pack_count = 0;
+	for(const auto &pack_name : packs) {
+		auto pack_group = packs.open_group(pack_name);
+		auto pack = observable_pack::read(pack_group);
+		auto members = pack_write(meas_file, pack_group, pack);
+		handled.insert(members.begin(), members.end());
+		pack_count++;
+	}
+
+	// New packs are made of the observables that were measured equally often so far. Internal
+	// observables and those already stored on their own are left alone. Observables without
+	// samples wait until they know their vector length.
+	std::map<std::tuple<size_t, size_t, size_t>, observable_pack> new_packs;
+	for(const auto &[name, obs] : observables_) {
+		if(handled.count(name) > 0 || name.rfind("_ll_", 0) == 0 || meas_file.exists(name)) {
+			continue;
+		}
+		if(obs.vector_length() == 0) {
+			handled.insert(name);
+			continue;
+		}
+
+		auto &pack = new_packs[{obs.bin_length(), obs.completed_bins(), obs.current_bin_filling()}];
+		pack.names.push_back(name);
+		pack.vector_lengths.push_back(obs.vector_length());
+		pack.bin_length = obs.bin_length();
+	}
+
+	for(const auto &[key, pack] : new_packs) {
+		(void)key;
+		auto pack_group = packs.open_group(std::to_string(pack_count++));
+		pack.write(pack_group);
+		auto members = pack_write(meas_file, pack_group, pack);
+		handled.insert(members.begin(), members.end());
+	}
+
+	return handled;
+}
+
+size_t measurements::pack_rows(const iodump::group &meas_file, const observable_pack &pack,
+                               std::vector<pack_member> &members) const {
+	members.assign(pack.names.size(), pack_member::left);
+	std::map<size_t, size_t> member_counts; // by number of completed bins
+	for(size_t i = 0; i < pack.names.size(); i++) {
+		if(observable_pack::has_left(meas_file, pack.names[i])) {
+			continue;
+		}
+		auto it = observables_.find(pack.names[i]);
+		if(it == observables_.end() || it->second.vector_length() != pack.vector_lengths[i] ||
+		   it->second.bin_length() != pack.bin_length) {
+			throw std::runtime_error{fmt::format(
+			    "packed observable '{}' does not match the measurement file", pack.names[i])};
+		}
+		members[i] = pack_member::staying;
+		member_counts[it->second.completed_bins()]++;
+	}
+
+	// the most common number of bins, or the largest of those, decides who stays.
+	size_t rows = 0;
+	size_t most_members = 0;
+	for(auto [bins, count] : member_counts) {
+		if(count >= most_members) {
+			rows = bins;
+			most_members = count;
+		}
+	}
+
+	for(size_t i = 0; i < members.size(); i++) {
+		if(members[i] == pack_member::staying &&
+		   observables_.at(pack.names[i]).completed_bins() != rows) {
+			members[i] = pack_member::leaving;
+		}
+	}
+	return rows;
+}
+
+std::vector<std::string> measurements::pack_write(const iodump::group &meas_file,
+                                                  const iodump::group &pack_group,
+                                                  const observable_pack &pack) {
+	std::vector<pack_member> member_states;
+	size_t rows = pack_rows(meas_file, pack, member_states);
+
+	// members that left the pack stay nullptr.
+	std::vector<observable *> members(pack.names.size());
+	for(size_t i = 0; i < members.size(); i++) {
+		if(member_states[i] == pack_member::leaving) {
+			leave_pack(meas_file, pack_group, pack, i);
+		} else if(member_states[i] == pack_member::staying) {
+			members[i] = &observables_.at(pack.names[i]);
+		}
+	}
+
+	// the columns of members that left are filled with zeros.
+	size_t row_length = pack.row_length();
+	std::vector<double> data(rows * row_length);
+	std::vector<std::string> names;
+	size_t offset = 0;
+	for(size_t i = 0; i < members.size(); i++) {
+		size_t vector_length = pack.vector_lengths[i];
+		if(members[i]) {
+			auto bins = members[i]->take_completed_bins();
+			for(size_t row = 0; row < rows; row++) {
+				std::copy(bins.begin() + row * vector_length,
+				          bins.begin() + (row + 1) * vector_length,
+				          data.begin() + row * row_length + offset);
+			}
+			names.push_back(pack.names[i]);
+		}
+		offset += vector_length;
+	}
+
+	observable::file_samples_append(pack_group, data, row_length);
+	size_t file_rows = observable::file_samples_size(pack_group) / row_length;
+	for(size_t i = 0; i < members.size(); i++) {
+		if(members[i]) {
+			members[i]->set_meas_file_extent(file_rows * pack.vector_lengths[i]);
+		}
+	}
+	return names;
+}
+
+// The column is copied before the group counts as complete, which is when it has samples. Its
+// completed bins in memory are then written like those of any unpacked observable.
+void measurements::leave_pack(const iodump::group &meas_file, const iodump::group &pack_group,
+                              const observable_pack &pack, size_t member) {
+	auto &obs = observables_.at(pack.names[member]);
+	size_t vector_length = pack.vector_lengths[member];
+	size_t row_length = pack.row_length();
+	size_t offset = 0;
+	for(size_t i = 0; i < member; i++) {
+		offset += pack.vector_lengths[i];
+	}
+
+	size_t rows = observable::file_samples_size(pack_group) / row_length;
+	if(obs.meas_file_extent() != observable::unknown_extent) {
+		rows = std::min(rows, obs.meas_file_extent() / vector_length);
+	}
+	std::vector<double> column;
+	pack_group.read_columns("samples", column, 0, rows, offset, vector_length);
+
+	auto g = meas_file.open_group(pack.names[member]);
+	g.write("vector_length", vector_length);
+	g.write("bin_length", pack.bin_length);
+	observable::file_samples_append(g, column);
+	obs.set_meas_file_extent(column.size());
+}
+
+bool measurements::buffer_full() const {
+	return buffer_limit_ > 0 && buffered_bytes_ > buffer_limit_;
+}
+
+void measurements::samples_truncate(const iodump::group &meas_file) {
+	for(const auto &obs_name : meas_file) {
+		if(obs_name != observable_pack::group_name) {
+			observable::repair_file_layout(meas_file.open_group(obs_name));
+		}
+	}
+
+	for(const auto &[name, obs] : observables_) {
+		(void)name;
+		if(obs.meas_file_extent() == observable::unknown_extent) {
+			return;
+		}
+	}
+
+	std::set<std::string> found;
+	for(const auto &obs_name : meas_file) {
+		auto obs_group = meas_file.open_group(obs_name);
+		if(obs_name == observable_pack::group_name) {
+			auto members = packs_truncate(meas_file);
+			found.insert(members.begin(), members.end());
+			continue;
+		}
+		if(!obs_group.exists("samples")) {
+			continue;
+		}
+
+		auto obs = observables_.find(obs_name);
+		if(obs != observables_.end()) {
+			obs->second.measurement_truncate(obs_group);
+			found.insert(obs_name);
+		} else if(observable::file_samples_size(obs_group) > 0) {
+			observable::file_samples_truncate(obs_group, 0);
+		}
+	}
+
+	// whatever the checkpoint says was written has to be somewhere.
+	for(const auto &[name, obs] : observables_) {
+		if(obs.meas_file_extent() > 0 && found.count(name) == 0) {
+			throw std::runtime_error{fmt::format(
+			    "observable '{}' is missing from the measurement file, which was damaged or "
+			    "modified.",
+			    name)};
+		}
+	}
+}
+
+std::set<std::string> measurements::packs_truncate(const iodump::group &meas_file) {
+	std::set<std::string> members;
+	auto packs = meas_file.open_group(observable_pack::group_name);
+	for(const auto &pack_name : packs) {
+		auto pack_group = packs.open_group(pack_name);
+		auto pack = observable_pack::read(pack_group);
+
+		// the members are written together, so they should agree, but a missing one means zero.
+		size_t rows = -1;
+		for(size_t i = 0; i < pack.names.size(); i++) {
+			if(observable_pack::has_left(meas_file, pack.names[i])) {
+				continue;
+			}
+			members.insert(pack.names[i]);
+			auto obs = observables_.find(pack.names[i]);
+			rows = std::min(rows, obs == observables_.end()
+			                          ? 0
+			                          : obs->second.meas_file_extent() / pack.vector_lengths[i]);
+		}
+
+		size_t extent = rows * pack.row_length();
+		size_t size = observable::file_samples_size(pack_group);
+		if(size < extent) {
+			throw std::runtime_error{fmt::format(
+			    "observable pack {}: the measurement file has {} values, but the checkpoint "
+			    "expects {}. It was damaged or modified.",
+			    pack_name, size, extent)};
+		}
+		if(size > extent) {
+			observable::file_samples_truncate(pack_group, extent);
+		}
 	}
+	return members;
 }
 
 void measurements::mpi_sendrecv(int target_rank) {
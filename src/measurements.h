@@ -10,9 +10,53 @@
 
 namespace loadl {
 
+// Refers to one observable so that samples can be added without looking it up by name.
+// Get one from measurements::get_handle. It stays valid as long as the measurements object.
+template<class T>
+class observable_handle {
+public:
+	observable_handle() = default;
+
+	void add(const T &value) {
+		obs_->add(value);
+	}
+
+private:
+	observable *obs_{};
+
+	explicit observable_handle(observable &obs) : obs_{&obs} {}
+	friend class measurements;
+};
+
+// Observables with the same bin length that share one two-dimensional dataset in the
+// measurement file. Each row holds one bin of every observable, one after another.
+struct observable_pack {
+	// the packs are the numbered subgroups of this group.
+	static constexpr const char *group_name = "_ll_packed";
+
+	std::vector<std::string> names;
+	std::vector<size_t> vector_lengths;
+	size_t bin_length{};
+
+	size_t row_length() const;
+
+	void write(const iodump::group &pack) const;
+	static observable_pack read(const iodump::group &pack);
+
+	// Members that are measured a different number of times than the rest of their pack leave
+	// it. Their bins are then in a group of their own like unpacked observables, which takes
+	// precedence over their column.
+	static bool has_left(const iodump::group &meas_file, const std::string &name);
+};
+
 class measurements {
 public:
-	measurements(size_t default_bin_size);
+	// If buffer_limit is nonzero, buffer_full tells when the samples held in memory exceed
+	// buffer_limit bytes. If packed is true, observables are stored in observable_packs.
+	measurements(size_t default_bin_size, size_t buffer_limit = 0, bool packed = false);
+	// the observables point to buffered_bytes_.
+	measurements(const measurements &) = delete;
+	measurements &operator=(const measurements &) = delete;
 
 	static bool observable_name_is_legal(const std::string &name);
 
@@ -22,14 +66,34 @@ public:
 
 	// use this to add a measurement sample to an observable.
 	template<class T>
-	void add(const std::string name, T value);
+	void add(const std::string &name, const T &value);
+
+	// Faster alternative to add for observables that are measured often. The observable is
+	// registered with the default bin size if it does not exist. You can get the handles in
+	// the constructor of your mc class, they survive checkpoint_read.
+	template<class T>
+	observable_handle<T> get_handle(const std::string &name);
 
+	// If packed is true, the checkpoints of all observables are stored in shared datasets.
 	void checkpoint_write(const iodump::group &dump_file);
 	void checkpoint_read(const iodump::group &dump_file);
 
 	// samples_write needs to be called before checkpoint_write and the meas_file
-	// should be opened in read/write mode.
-	void samples_write(const iodump::group &meas_file);
+	// should be opened in read/write mode. If max_bins is nonzero, observables with more
+	// bins than that in the file double their bin length. Packed observables do not.
+	void samples_write(const iodump::group &meas_file, size_t max_bins = 0);
+	// true if samples_write would only append to the samples datasets in meas_file within the
+	// room they already have, so that it can write to the file in place. meas_file may be
+	// read-only.
+	bool samples_fit(const iodump::group &meas_file, size_t max_bins = 0) const;
+
+	// true if samples_write should be called early to save memory.
+	bool buffer_full() const;
+
+	// The measurement file can be ahead of the checkpoint. This drops everything that was
+	// written after the checkpoint that was read last, so that those samples are not
+	// measured twice. Throws if the file holds less than the checkpoint expects.
+	void samples_truncate(const iodump::group &meas_file);
 
 	// switches the content of the measurement buffers with the target_rank
 	// both ranks must have the same set of observables!
@@ -40,6 +104,28 @@ private:
 	std::map<std::string, observable> observables_;
 
 	const size_t default_bin_size_{1};
+	const size_t buffer_limit_{0};
+	const bool packed_{false};
+	size_t buffered_bytes_{0}; // completed bins of all observables that were not written yet
+
+	void packed_checkpoint_write(const iodump::group &dump_file) const;
+	void packed_checkpoint_read(const iodump::group &dump_file);
+
+	enum class pack_member { left, leaving, staying };
+	// Decides which members of the pack write to it next and returns how many rows they write.
+	// Those are the members with the most common number of completed bins. The others leave.
+	size_t pack_rows(const iodump::group &meas_file, const observable_pack &pack,
+	                 std::vector<pack_member> &members) const;
+	// returns the names of the observables that were taken care of.
+	std::set<std::string> packed_samples_write(const iodump::group &meas_file);
+	// returns the names of the members that are still in the pack.
+	std::vector<std::string> pack_write(const iodump::group &meas_file,
+	                                    const iodump::group &pack_group,
+	                                    const observable_pack &pack);
+	void leave_pack(const iodump::group &meas_file, const iodump::group &pack_group,
+	                const observable_pack &pack, size_t member);
+	// returns the names of the members that are still in a pack.
+	std::set<std::string> packs_truncate(const iodump::group &meas_file);
 
 	template<class T>
 	size_t value_length(const T &val) {
@@ -52,11 +138,22 @@ private:
 };
 
 template<class T>
-void measurements::add(const std::string name, T value) {
+void measurements::add(const std::string &name, const T &value) {
+	auto it = observables_.find(name);
+	if(it == observables_.end()) {
+		register_observable(name, default_bin_size_);
+		it = observables_.find(name);
+	}
+
+	it->second.add(value);
+}
+
+template<class T>
+observable_handle<T> measurements::get_handle(const std::string &name) {
 	if(observables_.count(name) == 0) {
 		register_observable(name, default_bin_size_);
 	}
 
-	observables_.at(name).add(value);
+	return observable_handle<T>{observables_.at(name)};
 }
 }
@@ -2,16 +2,534 @@
 #include "iodump.h"
 #include "mc.h"
 #include "measurements.h"
+#include "util.h"
 
+#include <algorithm>
+#include <array>
 #include <fmt/format.h>
 #include <iostream>
+#include <map>
+#include <mpi.h>
 #include <string>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 namespace loadl {
 
+// Gives access to the observables of one measurement file, whether they have their own group or
+// are part of an observable_pack. Observables with their own group are read in pieces, a pack
+// is read in one piece the first time one of its observables is needed.
+//
+// All file access takes iodump::mutex, so that several threads can have their own readers.
+class meas_file_reader {
+public:
+	explicit meas_file_reader(const std::filesystem::path &filename)
+	    : lock_{iodump::mutex()}, file_{iodump::open_readonly(filename)},
+	      root_{file_.get_root()} {
+		for(const auto &name : root_) {
+			if(name != observable_pack::group_name) {
+				names_.push_back(name);
+			}
+		}
+
+		if(root_.exists(observable_pack::group_name)) {
+			read_packs();
+		}
+		lock_.unlock();
+	}
+
+	// the file is closed after the destructor body, while lock_ is still held.
+	~meas_file_reader() {
+		lock_.lock();
+	}
+
+	const std::vector<std::string> &observables() const {
+		return names_;
+	}
+
+	bool exists(const std::string &obs_name) const {
+		std::lock_guard<std::recursive_mutex> lock{iodump::mutex()};
+		return columns_.count(obs_name) > 0 ||
+		       (obs_name != observable_pack::group_name && root_.exists(obs_name));
+	}
+
+	// number of doubles in the samples
+	size_t sample_size(const std::string &obs_name) const {
+		std::lock_guard<std::recursive_mutex> lock{iodump::mutex()};
+		auto col = columns_.find(obs_name);
+		if(col == columns_.end()) {
+			return observable::file_samples_size(root_.open_group(obs_name));
+		}
+		return pack_rows_[col->second.pack] * col->second.vector_length;
+	}
+
+	size_t vector_length(const std::string &obs_name) const {
+		return read_metadata(obs_name, "vector_length");
+	}
+
+	size_t bin_length(const std::string &obs_name) const {
+		return read_metadata(obs_name, "bin_length");
+	}
+
+	// reads count bins starting at bin first into bins.
+	void read_bins(const std::string &obs_name, size_t first, size_t count,
+	               std::vector<double> &bins) {
+		std::lock_guard<std::recursive_mutex> lock{iodump::mutex()};
+		auto col = columns_.find(obs_name);
+		if(col == columns_.end()) {
+			// the dataset has room beyond the samples it holds.
+			size_t size = sample_size(obs_name);
+			size_t vector_length = this->vector_length(obs_name);
+			count = std::min(count * vector_length, size - std::min(first * vector_length, size));
+			auto obs_group = root_.open_group(obs_name);
+			obs_group.read_range(observable::current_file_layout(obs_group).samples, bins,
+			                     first * vector_length, count);
+			return;
+		}
+
+		auto [pack_idx, offset, vector_length] = col->second;
+		auto &data = pack_samples_[pack_idx];
+		if(data.empty() && pack_rows_[pack_idx] > 0) {
+			root_.open_group(observable_pack::group_name)
+			    .open_group(pack_names_[pack_idx])
+			    .read_range("samples", data, 0, pack_rows_[pack_idx]);
+		}
+
+		size_t row_length = packs_[pack_idx].row_length();
+		count = std::min(count, pack_rows_[pack_idx] - std::min(first, pack_rows_[pack_idx]));
+		bins.resize(count * vector_length);
+		for(size_t row = 0; row < count; row++) {
+			auto row_begin = data.begin() + (first + row) * row_length + offset;
+			std::copy(row_begin, row_begin + vector_length, bins.begin() + row * vector_length);
+		}
+	}
+
+	// reads bin idx without loading the whole pack.
+	void read_bin(const std::string &obs_name, size_t idx, std::vector<double> &bin) {
+		std::lock_guard<std::recursive_mutex> lock{iodump::mutex()};
+		auto col = columns_.find(obs_name);
+		if(col == columns_.end() || !pack_samples_[col->second.pack].empty() ||
+		   idx >= pack_rows_[col->second.pack]) {
+			read_bins(obs_name, idx, 1, bin);
+			return;
+		}
+
+		auto [pack_idx, offset, vector_length] = col->second;
+		std::vector<double> row;
+		root_.open_group(observable_pack::group_name)
+		    .open_group(pack_names_[pack_idx])
+		    .read_range("samples", row, idx, 1);
+		bin.assign(row.begin() + std::min(row.size(), offset),
+		           row.begin() + std::min(row.size(), offset + vector_length));
+	}
+
+private:
+	struct column {
+		size_t pack;
+		size_t offset;
+		size_t vector_length;
+	};
+
+	std::unique_lock<std::recursive_mutex> lock_;
+	iodump file_;
+	iodump::group root_;
+	std::vector<std::string> names_;
+	std::map<std::string, column> columns_;
+	std::vector<observable_pack> packs_;
+	std::vector<std::string> pack_names_;
+	std::vector<size_t> pack_rows_;
+	std::vector<std::vector<double>> pack_samples_;
+
+	void read_packs() {
+		auto packs = root_.open_group(observable_pack::group_name);
+		for(const auto &pack_name : packs) {
+			auto pack_group = packs.open_group(pack_name);
+			auto pack = observable_pack::read(pack_group);
+			size_t offset = 0;
+			for(size_t i = 0; i < pack.names.size(); i++) {
+				// a group of the same name without samples was cut short while leaving.
+				if(!observable_pack::has_left(root_, pack.names[i])) {
+					columns_[pack.names[i]] = {packs_.size(), offset, pack.vector_lengths[i]};
+					if(!root_.exists(pack.names[i])) {
+						names_.push_back(pack.names[i]);
+					}
+				}
+				offset += pack.vector_lengths[i];
+			}
+			pack_rows_.push_back(observable::file_samples_size(pack_group) / pack.row_length());
+			packs_.push_back(std::move(pack));
+			pack_names_.push_back(pack_name);
+		}
+		pack_samples_.resize(packs_.size());
+	}
+
+	size_t read_metadata(const std::string &obs_name, const std::string &field) const {
+		std::lock_guard<std::recursive_mutex> lock{iodump::mutex()};
+		auto col = columns_.find(obs_name);
+		if(col != columns_.end()) {
+			return field == "bin_length" ? packs_[col->second.pack].bin_length
+			                             : col->second.vector_length;
+		}
+
+		size_t value;
+		auto obs_group = root_.open_group(obs_name);
+		obs_group.read(field == "bin_length" ? observable::current_file_layout(obs_group).bin_length
+		                                     : field,
+		               value);
+		return value;
+	}
+};
+
+
+// running sums of one observable while its samples are streamed.
+struct obs_accumulator {
+	size_t current_rebin = 0;
+	size_t current_rebin_filling = 0;
+	size_t sample_counter = 0;
+
+	// 0 if the bin lengths of the runs are incompatible. Then all bins are treated the same.
+	size_t common_bin_length = 0;
+
+	// Welford’s running mean and sum of squared deviations for the naive error.
+	std::vector<double> running_mean;
+	std::vector<double> squared_deviations;
+
+	// for every file: the number of bins, their length and the index of the next bin to read.
+	std::vector<size_t> file_bin_counts;
+	std::vector<size_t> file_bin_lengths;
+	std::vector<size_t> positions;
+
+	// number of file bins that one merged bin is made of.
+	size_t factor(size_t file) const {
+		return common_bin_length == 0 ? 1 : common_bin_length / file_bin_lengths[file];
+	}
+
+	// the bins from here on are not read.
+	size_t end_position(size_t file, size_t skip) const {
+		size_t count = file_bin_counts[file];
+		if(count <= skip) {
+			return skip;
+		}
+		return skip + (count - skip) / factor(file) * factor(file);
+	}
+};
+
+// number of doubles read from a measurement file at a time.
+static const size_t merge_chunk_size = 1 << 16;
+
+// Streams the bins [begin, end) of one run to process, which gets a pointer to bin_count bins and
+// returns false once it does not need more. Runs whose bin length was doubled less often than
+// others have shorter bins. Their bins are averaged in groups of factor to get the common bin
+// length.
+template<class F>
+static void stream_samples(meas_file_reader &meas_file, const std::string &obs_name,
+                           size_t vector_length, size_t begin, size_t end, size_t factor,
+                           F process) {
+	size_t chunk_bins = std::max<size_t>(1, merge_chunk_size / vector_length / factor) * factor;
+
+	std::vector<double> chunk;
+	std::vector<double> merged;
+	for(size_t first = begin; first + factor <= end; first += chunk_bins) {
+		size_t count = std::min(chunk_bins, end - first) / factor * factor;
+		meas_file.read_bins(obs_name, first, count, chunk);
+
+		if(factor == 1) {
+			if(!process(chunk.data(), count)) {
+				return;
+			}
+			continue;
+		}
+
+		size_t bin_count = count / factor;
+		merged.assign(bin_count * vector_length, 0);
+		for(size_t i = 0; i < bin_count; i++) {
+			for(size_t k = 0; k < factor; k++) {
+				for(size_t j = 0; j < vector_length; j++) {
+					merged[i * vector_length + j] += chunk[(i * factor + k) * vector_length + j];
+				}
+			}
+			for(size_t j = 0; j < vector_length; j++) {
+				merged[i * vector_length + j] /= factor;
+			}
+		}
+		if(!process(merged.data(), bin_count)) {
+			return;
+		}
+	}
+}
+
+// The merge cache holds the accumulators of the last merge of a task, so that the next merge only
+// reads the bins that were added since. It is only used where that gives exactly the same results
+// as merging from scratch: the bins that were read last time have to be the beginning of what
+// would be read now.
+namespace {
+struct cached_accumulator {
+	obs_accumulator acc;
+	std::vector<double> mean;
+	std::vector<double> rebinning_means;
+	// the last bin read from each file
+	std::vector<double> last_bins;
+};
+}
+
+static std::vector<std::string> file_names(const std::vector<std::filesystem::path> &filenames) {
+	std::vector<std::string> names;
+	for(const auto &filename : filenames) {
+		names.push_back(filename.filename().string());
+	}
+	return names;
+}
+
+static void file_stamps(const std::vector<std::filesystem::path> &filenames,
+                        std::vector<size_t> &sizes, std::vector<long long> &times) {
+	for(const auto &filename : filenames) {
+		sizes.push_back(std::filesystem::file_size(filename));
+		times.push_back(std::filesystem::last_write_time(filename).time_since_epoch().count());
+	}
+}
+
+// '/' cannot appear in file names.
+static std::string join_names(const std::vector<std::string> &names) {
+	std::string joined;
+	for(const auto &name : names) {
+		joined += name + "/";
+	}
+	return joined;
+}
+
+// returns the number of files the cache knows or -1 if the cache does not fit.
+static int read_cache_header(const iodump::group &root,
+                             const std::vector<std::filesystem::path> &filenames,
+                             size_t rebinning_bin_length, size_t sample_skip,
+                             bool fft_autocorrelation) {
+	size_t cached_rebinning_bin_length, cached_sample_skip;
+	int cached_fft_autocorrelation;
+	std::string cached_files;
+	root.read("rebinning_bin_length", cached_rebinning_bin_length);
+	root.read("sample_skip", cached_sample_skip);
+	root.read("fft_autocorrelation", cached_fft_autocorrelation);
+	root.read("files", cached_files);
+
+	if(cached_rebinning_bin_length != rebinning_bin_length || cached_sample_skip != sample_skip ||
+	   cached_fft_autocorrelation != fft_autocorrelation ||
+	   join_names(file_names(filenames)).rfind(cached_files, 0) != 0) {
+		return -1;
+	}
+	return std::count(cached_files.begin(), cached_files.end(), '/');
+}
+
+bool merge_cache_is_current(const std::filesystem::path &cache_filename,
+                            const std::vector<std::filesystem::path> &filenames,
+                            size_t rebinning_bin_length, size_t sample_skip,
+                            bool fft_autocorrelation) {
+	if(!std::filesystem::exists(cache_filename)) {
+		return false;
+	}
+
+	std::vector<size_t> sizes, cached_sizes;
+	std::vector<long long> times, cached_times;
+	file_stamps(filenames, sizes, times);
+
+	std::lock_guard<std::recursive_mutex> lock{iodump::mutex()};
+	try {
+		iodump cache = iodump::open_readonly(cache_filename);
+		auto root = cache.get_root();
+		int cached_file_count = read_cache_header(root, filenames, rebinning_bin_length,
+		                                          sample_skip, fft_autocorrelation);
+		root.read("file_sizes", cached_sizes);
+		root.read("file_times", cached_times);
+		return cached_file_count == static_cast<int>(filenames.size()) && sizes == cached_sizes &&
+		       times == cached_times;
+	} catch(const iodump_exception &e) {
+		return false;
+	}
+}
+
+// restores the accumulators that can go on from where the last merge stopped.
+static void read_merge_cache(const std::filesystem::path &cache_filename,
+                             const std::vector<std::filesystem::path> &filenames,
+                             size_t rebinning_bin_length, size_t sample_skip,
+                             bool fft_autocorrelation, results &res,
+                             std::map<std::string, obs_accumulator> &accumulators) {
+	if(!std::filesystem::exists(cache_filename)) {
+		return;
+	}
+
+	std::lock_guard<std::recursive_mutex> lock{iodump::mutex()};
+	std::map<std::string, cached_accumulator> cached;
+	size_t file_count = 0;
+	try {
+		iodump cache = iodump::open_readonly(cache_filename);
+		auto root = cache.get_root();
+		int cached_file_count = read_cache_header(root, filenames, rebinning_bin_length,
+		                                          sample_skip, fft_autocorrelation);
+		if(cached_file_count < 0) {
+			return;
+		}
+		file_count = cached_file_count;
+
+		auto observables = root.open_group("observables");
+		for(const auto &obs_name : observables) {
+			auto it = res.observables.find(obs_name);
+			if(it == res.observables.end()) {
+				continue;
+			}
+			auto &obs = it->second;
+			auto &acc = accumulators.at(obs_name);
+			auto g = observables.open_group(obs_name);
+
+			size_t common_bin_length, rebinning_bin_length, rebinning_bin_count;
+			g.read("common_bin_length", common_bin_length);
+			g.read("rebinning_bin_length", rebinning_bin_length);
+			g.read("rebinning_bin_count", rebinning_bin_count);
+			if(common_bin_length != acc.common_bin_length ||
+			   rebinning_bin_length != obs.rebinning_bin_length ||
+			   rebinning_bin_count > obs.rebinning_bin_count) {
+				continue;
+			}
+
+			cached_accumulator c;
+			g.read("file_bin_lengths", c.acc.file_bin_lengths);
+			g.read("positions", c.acc.positions);
+			g.read("sample_counter", c.acc.sample_counter);
+			g.read("current_rebin", c.acc.current_rebin);
+			g.read("current_rebin_filling", c.acc.current_rebin_filling);
+			g.read("running_mean", c.acc.running_mean);
+			g.read("squared_deviations", c.acc.squared_deviations);
+			g.read("mean", c.mean);
+			g.read("rebinning_means", c.rebinning_means);
+			g.read("last_bins", c.last_bins);
+			if(c.mean.size() != obs.mean.size() || c.acc.positions.size() != file_count) {
+				continue;
+			}
+
+			// Files before the last one that was read from must be read completely, both then
+			// and now.
+			bool fits = true;
+			bool later_file_read = false;
+			for(size_t f = file_count; f-- > 0;) {
+				size_t position = c.acc.positions[f];
+				size_t end_position = acc.end_position(f, sample_skip);
+				if(position != sample_skip) {
+					fits = fits && c.acc.file_bin_lengths[f] == acc.file_bin_lengths[f];
+				}
+				if(later_file_read) {
+					fits = fits && position == end_position;
+				} else if(position != sample_skip) {
+					fits = fits && position <= end_position;
+					later_file_read = true;
+				}
+			}
+			if(fits) {
+				cached.emplace(obs_name, std::move(c));
+			}
+		}
+	} catch(const iodump_exception &e) {
+		std::cerr << fmt::format("merge: ignoring the merge cache: {}\n", e.what());
+		return;
+	}
+
+	// The bins that were read last have to be the same. Otherwise the run was restarted from a
+	// checkpoint and measured something else.
+	for(size_t f = 0; f < file_count; f++) {
+		meas_file_reader meas_file{filenames[f]};
+		for(auto it = cached.begin(); it != cached.end();) {
+			auto &c = it->second;
+			size_t vector_length = c.mean.size();
+			std::vector<double> bin;
+			if(c.acc.positions[f] != sample_skip) {
+				meas_file.read_bin(it->first, c.acc.positions[f] - 1, bin);
+			}
+			if(c.acc.positions[f] != sample_skip &&
+			   !std::equal(bin.begin(), bin.end(), c.last_bins.begin() + f * vector_length,
+			               c.last_bins.begin() + (f + 1) * vector_length)) {
+				it = cached.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	for(auto &[obs_name, c] : cached) {
+		auto &obs = res.observables.at(obs_name);
+		auto &acc = accumulators.at(obs_name);
+		acc.sample_counter = c.acc.sample_counter;
+		acc.current_rebin = c.acc.current_rebin;
+		acc.current_rebin_filling = c.acc.current_rebin_filling;
+		acc.running_mean = c.acc.running_mean;
+		acc.squared_deviations = c.acc.squared_deviations;
+		std::copy(c.acc.positions.begin(), c.acc.positions.end(), acc.positions.begin());
+		obs.mean = c.mean;
+		std::copy(c.rebinning_means.begin(), c.rebinning_means.end(),
+		          obs.rebinning_means.begin());
+	}
+}
+
+// sizes and times are taken before the merge, in case the files change in the meantime.
+static void write_merge_cache(const std::filesystem::path &cache_filename,
+                              const std::vector<std::filesystem::path> &filenames,
+                              const std::vector<size_t> &sizes,
+                              const std::vector<long long> &times, size_t rebinning_bin_length,
+                              size_t sample_skip, bool fft_autocorrelation, const results &res,
+                              const std::map<std::string, obs_accumulator> &accumulators) {
+	std::map<std::string, std::vector<double>> last_bins;
+	for(size_t f = 0; f < filenames.size(); f++) {
+		meas_file_reader meas_file{filenames[f]};
+		for(const auto &[obs_name, obs] : res.observables) {
+			const auto &acc = accumulators.at(obs_name);
+			auto &bins = last_bins[obs_name];
+			std::vector<double> bin(obs.mean.size());
+			if(acc.positions[f] != sample_skip) {
+				meas_file.read_bin(obs_name, acc.positions[f] - 1, bin);
+			}
+			bins.insert(bins.end(), bin.begin(), bin.end());
+		}
+	}
+
+	// concurrent merges of the same task should not write into the same file.
+	std::filesystem::path tmp_filename =
+	    fmt::format("{}.{}.tmp", cache_filename.string(), getpid());
+	{
+		std::lock_guard<std::recursive_mutex> lock{iodump::mutex()};
+		iodump cache = iodump::create(tmp_filename);
+		auto root = cache.get_root();
+		root.write("rebinning_bin_length", rebinning_bin_length);
+		root.write("sample_skip", sample_skip);
+		root.write("fft_autocorrelation", static_cast<int>(fft_autocorrelation));
+		root.write("files", join_names(file_names(filenames)));
+		root.write("file_sizes", sizes);
+		root.write("file_times", times);
+
+		auto observables = root.open_group("observables");
+		for(const auto &[obs_name, obs] : res.observables) {
+			const auto &acc = accumulators.at(obs_name);
+			if(obs.rebinning_bin_count == 0) {
+				continue;
+			}
+
+			auto g = observables.open_group(obs_name);
+			g.write("common_bin_length", acc.common_bin_length);
+			g.write("rebinning_bin_length", obs.rebinning_bin_length);
+			g.write("rebinning_bin_count", obs.rebinning_bin_count);
+			g.write("file_bin_lengths", acc.file_bin_lengths);
+			g.write("positions", acc.positions);
+			g.write("sample_counter", acc.sample_counter);
+			g.write("current_rebin", acc.current_rebin);
+			g.write("current_rebin_filling", acc.current_rebin_filling);
+			g.write("running_mean", acc.running_mean);
+			g.write("squared_deviations", acc.squared_deviations);
+			g.write("mean", obs.mean);
+			g.write("rebinning_means", obs.rebinning_means);
+			g.write("last_bins", last_bins.at(obs_name));
+		}
+	}
+	std::filesystem::rename(tmp_filename, cache_filename);
+}
+
 results merge(const std::vector<std::filesystem::path> &filenames, size_t rebinning_bin_length,
-              size_t sample_skip) {
+              size_t sample_skip, unsigned threads, MPI_Comm comm,
+              const std::filesystem::path &cache_filename, bool fft_autocorrelation) {
 	results res;
 
 	class merge_error : public std::runtime_error {
@@ -19,33 +537,35 @@ results merge(const std::vector<std::filesystem::path> &filenames, size_t rebinn
 		merge_error(const std::string &msg) : std::runtime_error{msg} {}
 	};
 
-	// This thing reads the complete time series of an observable which will
-	// probably make it the biggest memory user of load leveller. But since
-	// it’s only one observable of one run at a time, it is maybe still okay.
-
-	// If not, research a custom solution using fancy HDF5 virtual datasets or something.
-
-	// In the first pass we gather the metadata to decide on the rebinning_bin_length.
+	// The samples are streamed from the files in chunks, so only the rebinned means of an
+	// observable are kept in memory. Before that, we have to know how many samples there are,
+	// so a first pass gathers the metadata to decide on the rebinning_bin_length.
+	// Runs may have different bin lengths, so the sample counts are only known afterwards.
+	std::map<std::string, obs_accumulator> accumulators;
+
+	bool use_cache = !cache_filename.empty() && comm == MPI_COMM_NULL;
+	std::vector<size_t> file_sizes;
+	std::vector<long long> file_times;
+	if(use_cache) {
+		file_stamps(filenames, file_sizes, file_times);
+	}
 
-	for(auto &filename : filenames) {
-		iodump meas_file = iodump::open_readonly(filename);
-		auto g = meas_file.get_root();
-		for(const auto &obs_name : g) {
+	for(size_t file_idx = 0; file_idx < filenames.size(); file_idx++) {
+		const auto &filename = filenames[file_idx];
+		meas_file_reader meas_file{filename};
+		for(const auto &obs_name : meas_file.observables()) {
 			size_t vector_length{};
 			size_t internal_bin_length{};
-			std::vector<double> samples;
 
-			auto obs_group = g.open_group(obs_name);
 			try {
-				size_t sample_size = obs_group.get_extent("samples");
+				size_t sample_size = meas_file.sample_size(obs_name);
 
 				if(sample_size == 0) { // ignore empty observables
 					continue;
 				}
 
-				obs_group.read("bin_length", internal_bin_length);
-				obs_group.read("vector_length", vector_length);
-				obs_group.read("samples", samples);
+				internal_bin_length = meas_file.bin_length(obs_name);
+				vector_length = meas_file.vector_length(obs_name);
 
 				if(vector_length == 0) {
 					throw merge_error{"zero vector_length"};
@@ -59,11 +579,17 @@ results merge(const std::vector<std::filesystem::path> &filenames, size_t rebinn
 					res.observables.emplace(obs_name, observable_result());
 				auto &obs = res.observables.at(obs_name);
 				obs.name = obs_name;
-				obs.internal_bin_length = internal_bin_length;
+				obs.internal_bin_length = std::max(obs.internal_bin_length, internal_bin_length);
 
 				sample_size /= vector_length;
 
-				obs.total_sample_count += sample_size - std::min(sample_size, sample_skip);
+				auto &acc = accumulators[obs_name];
+				acc.file_bin_counts.resize(filenames.size());
+				acc.file_bin_lengths.resize(filenames.size());
+				acc.positions.assign(filenames.size(), sample_skip);
+				acc.file_bin_counts[file_idx] = sample_size;
+				acc.file_bin_lengths[file_idx] = internal_bin_length;
+
 				obs.mean.resize(vector_length);
 				obs.error.resize(vector_length);
 				obs.autocorrelation_time.resize(vector_length);
@@ -76,16 +602,36 @@ results merge(const std::vector<std::filesystem::path> &filenames, size_t rebinn
 		}
 	}
 
-	struct obs_rebinning_metadata {
-		size_t current_rebin = 0;
-		size_t current_rebin_filling = 0;
-		size_t sample_counter = 0;
-	};
-
-	std::map<std::string, obs_rebinning_metadata> metadata;
-
 	for(auto &entry : res.observables) {
 		auto &obs = entry.second;
+		auto &acc = accumulators.at(obs.name);
+
+		// the files that contain the observable, with the bins after the skipped ones.
+		std::vector<std::pair<size_t, size_t>> run_sizes;
+		for(size_t i = 0; i < filenames.size(); i++) {
+			size_t count = acc.file_bin_counts[i];
+			if(count > 0) {
+				run_sizes.emplace_back(count - std::min(count, sample_skip),
+				                       acc.file_bin_lengths[i]);
+			}
+		}
+
+		size_t bin_length = obs.internal_bin_length;
+		for(auto [sample_size, run_bin_length] : run_sizes) {
+			(void)sample_size;
+			if(bin_length % run_bin_length != 0) {
+				std::cerr << fmt::format(
+				    "merge: {}: runs have incompatible bin lengths. Mixing them...\n", obs.name);
+				bin_length = 0;
+				break;
+			}
+		}
+		acc.common_bin_length = bin_length;
+
+		for(auto [sample_size, run_bin_length] : run_sizes) {
+			obs.total_sample_count +=
+			    bin_length == 0 ? sample_size : sample_size / (bin_length / run_bin_length);
+		}
 
 		if(rebinning_bin_length == 0) {
 			// no rebinning before this
@@ -107,45 +653,182 @@ results merge(const std::vector<std::filesystem::path> &filenames, size_t rebinn
 		obs.rebinning_means.resize(obs.rebinning_bin_count * obs.mean.size());
 		obs.rebinning_bin_length = obs.total_sample_count / obs.rebinning_bin_count;
 
-		metadata.emplace(obs.name, obs_rebinning_metadata{});
+		acc.running_mean.resize(obs.mean.size());
+		acc.squared_deviations.resize(obs.mean.size());
 	}
 
-	for(auto &filename : filenames) {
-		iodump meas_file = iodump::open_readonly(filename);
-		auto g = meas_file.get_root();
-		for(auto &[obs_name, obs] : res.observables) {
-			std::vector<double> samples;
-			obs.name = obs_name;
+	if(use_cache) {
+		read_merge_cache(cache_filename, filenames, rebinning_bin_length, sample_skip,
+		                 fft_autocorrelation, res, accumulators);
+	}
 
-			if(!g.exists(obs_name)) {
-				continue;
+	// Each observable is merged by one thread, file by file, so the results do not depend on the
+	// number of threads. The threads get contiguous ranges of observables of similar size.
+	std::vector<std::pair<observable_result *, obs_accumulator *>> work;
+	std::vector<size_t> work_sizes{0};
+	for(auto &[obs_name, obs] : res.observables) {
+		work.emplace_back(&obs, &accumulators.at(obs_name));
+		work_sizes.push_back(work_sizes.back() + obs.total_sample_count * obs.mean.size() + 1);
+	}
+
+	auto merge_observables = [&](size_t begin, size_t end) {
+		for(size_t file_idx = 0; file_idx < filenames.size(); file_idx++) {
+			meas_file_reader meas_file{filenames[file_idx]};
+			for(size_t w = begin; w < end; w++) {
+				auto &obs = *work[w].first;
+				auto &acc = *work[w].second;
+				size_t vector_length = obs.mean.size();
+				size_t &position = acc.positions[file_idx];
+				size_t end_position = acc.end_position(file_idx, sample_skip);
+
+				// rebinning_bin_count*rebinning_bin_length may be smaller than
+				// total_sample_count. In that case, we throw away the leftover samples.
+				size_t used_samples = obs.rebinning_bin_count * obs.rebinning_bin_length;
+				if(position >= end_position || acc.sample_counter >= used_samples) {
+					continue;
+				}
+
+				size_t factor = acc.factor(file_idx);
+				stream_samples(
+				    meas_file, obs.name, vector_length, position, end_position, factor,
+				    [&](const double *bins, size_t bin_count) {
+					    for(size_t i = 0; i < bin_count && acc.sample_counter < used_samples;
+					        i++) {
+						    position += factor;
+						    const double *bin = bins + i * vector_length;
+						    double *rebin = &obs.rebinning_means[acc.current_rebin * vector_length];
+						    acc.sample_counter++;
+
+						    for(size_t j = 0; j < vector_length; j++) {
+							    obs.mean[j] += bin[j];
+							    rebin[j] += bin[j];
+
+							    double delta = bin[j] - acc.running_mean[j];
+							    acc.running_mean[j] += delta / acc.sample_counter;
+							    acc.squared_deviations[j] += delta * (bin[j] - acc.running_mean[j]);
+						    }
+
+						    acc.current_rebin_filling++;
+						    if(acc.current_rebin_filling >= obs.rebinning_bin_length) {
+							    acc.current_rebin++;
+							    acc.current_rebin_filling = 0;
+						    }
+					    }
+					    return acc.sample_counter < used_samples;
+				    });
 			}
+		}
+	};
 
-			g.read(fmt::format("{}/samples", obs_name), samples);
+	// The FFT autocorrelation needs the whole series of every run, so it reads the same bins
+	// again. Like the merge, it goes file by file, and only one series is held at a time.
+	std::vector<std::vector<double>> fft_autocorrelation_times(work.size());
+	auto autocorrelate_observables = [&](size_t begin, size_t end) {
+		std::vector<autocorrelation> acorrs;
+		for(size_t w = begin; w < end; w++) {
+			acorrs.emplace_back(work[w].first->mean.size());
+		}
+
+		std::vector<double> series;
+		for(size_t file_idx = 0; file_idx < filenames.size(); file_idx++) {
+			meas_file_reader meas_file{filenames[file_idx]};
+			for(size_t w = begin; w < end; w++) {
+				auto &obs = *work[w].first;
+				auto &acc = *work[w].second;
+				size_t vector_length = obs.mean.size();
+				if(obs.rebinning_bin_count == 0 || acc.positions[file_idx] <= sample_skip) {
+					continue;
+				}
 
-			// rebinning_bin_count*rebinning_bin_length may be smaller than
-			// total_sample_count. In that case, we throw away the leftover samples.
-			//
-			size_t vector_length = obs.mean.size();
-			for(size_t i = sample_skip * vector_length;
-			    metadata[obs_name].sample_counter <
-			        obs.rebinning_bin_count * obs.rebinning_bin_length &&
-			    i < samples.size();
-			    i++) {
-				size_t vector_idx = i % vector_length;
+				series.clear();
+				stream_samples(meas_file, obs.name, vector_length, sample_skip,
+				               acc.positions[file_idx], acc.factor(file_idx),
+				               [&](const double *bins, size_t bin_count) {
+					               series.insert(series.end(), bins,
+					                             bins + bin_count * vector_length);
+					               return true;
+				               });
+				acorrs[w - begin].add_series(series, series.size() / vector_length);
+			}
+		}
 
-				obs.mean[vector_idx] += samples[i];
+		for(size_t w = begin; w < end; w++) {
+			if(work[w].first->rebinning_bin_count != 0) {
+				fft_autocorrelation_times[w] = acorrs[w - begin].integrated_time();
+			}
+		}
+	};
+	auto merge_range = [&](size_t begin, size_t end) {
+		merge_observables(begin, end);
+		if(fft_autocorrelation) {
+			autocorrelate_observables(begin, end);
+		}
+	};
 
-				if(vector_idx == vector_length - 1) {
-					metadata[obs_name].sample_counter++;
+	// With MPI, the ranks get contiguous ranges of observables which they split between their
+	// threads.
+	int rank = 0;
+	int size = 1;
+	if(comm != MPI_COMM_NULL) {
+		MPI_Comm_rank(comm, &rank);
+		MPI_Comm_size(comm, &size);
+	}
+	auto split = [&](size_t begin, size_t end, size_t part, size_t parts) {
+		if(part == parts) {
+			return end;
+		}
+		size_t target = work_sizes[begin] + (work_sizes[end] - work_sizes[begin]) * part / parts;
+		size_t idx =
+		    std::lower_bound(work_sizes.begin(), work_sizes.end(), target) - work_sizes.begin();
+		return std::max(begin, std::min(idx, end));
+	};
+	size_t rank_begin = split(0, work.size(), rank, size);
+	size_t rank_end = split(0, work.size(), rank + 1, size);
+
+	threads = std::max<size_t>(1, std::min<size_t>(threads, rank_end - rank_begin));
+	if(threads == 1) {
+		merge_range(rank_begin, rank_end);
+	} else {
+		std::vector<std::thread> workers;
+		std::vector<std::exception_ptr> errors(threads);
+		for(size_t t = 0; t < threads; t++) {
+			size_t begin = split(rank_begin, rank_end, t, threads);
+			size_t end = split(rank_begin, rank_end, t + 1, threads);
+			workers.emplace_back([&, t, begin, end]() {
+				try {
+					merge_range(begin, end);
+				} catch(...) {
+					errors[t] = std::current_exception();
 				}
+			});
+		}
+		for(auto &worker : workers) {
+			worker.join();
+		}
+		for(auto &error : errors) {
+			if(error) {
+				std::rethrow_exception(error);
 			}
 		}
 	}
 
-	for(auto &[obs_name, obs] : res.observables) {
-		assert(metadata[obs_name].sample_counter ==
-		       obs.rebinning_bin_count * obs.rebinning_bin_length);
+	if(use_cache) {
+		try {
+			write_merge_cache(cache_filename, filenames, file_sizes, file_times,
+			                  rebinning_bin_length, sample_skip, fft_autocorrelation, res,
+			                  accumulators);
+		} catch(const iodump_exception &e) {
+			std::cerr << fmt::format("merge: could not write the merge cache: {}\n", e.what());
+		} catch(const std::filesystem::filesystem_error &e) {
+			std::cerr << fmt::format("merge: could not write the merge cache: {}\n", e.what());
+		}
+	}
+
+	for(size_t w = rank_begin; w < rank_end; w++) {
+		auto &obs = *work[w].first;
+		auto &acc = *work[w].second;
+		assert(acc.sample_counter == obs.rebinning_bin_count * obs.rebinning_bin_length);
+		assert(acc.current_rebin == obs.rebinning_bin_count);
 		if(obs.rebinning_bin_count == 0) {
 			continue;
 		}
@@ -153,62 +836,21 @@ results merge(const std::vector<std::filesystem::path> &filenames, size_t rebinn
 		for(auto &mean : obs.mean) {
 			mean /= obs.rebinning_bin_count * obs.rebinning_bin_length;
 		}
-		metadata[obs_name].sample_counter = 0;
-	}
-
-	// now handle the error and autocorrelation time which are calculated by rebinning.
-	for(auto &filename : filenames) {
-		iodump meas_file = iodump::open_readonly(filename);
-		auto g = meas_file.get_root();
-		for(auto &[obs_name, obs] : res.observables) {
-			std::vector<double> samples;
-			auto &obs_meta = metadata.at(obs_name);
-
-			size_t vector_length = obs.mean.size();
-
-			if(!g.exists(obs_name)) {
-				continue;
-			}
-
-			g.read(fmt::format("{}/samples", obs_name), samples);
-
-			for(size_t i = sample_skip * vector_length;
-			    obs_meta.current_rebin < obs.rebinning_bin_count && i < samples.size(); i++) {
-				size_t vector_idx = i % vector_length;
-
-				size_t rebin_idx = obs_meta.current_rebin * vector_length + vector_idx;
-
-				obs.rebinning_means[rebin_idx] += samples[i];
-
-				if(vector_idx == 0)
-					obs_meta.current_rebin_filling++;
 
-				// I used autocorrelation_time as a buffer here to hold the naive no-rebinning error
-				// (sorry)
-				obs.autocorrelation_time[vector_idx] +=
-				    (samples[i] - obs.mean[vector_idx]) * (samples[i] - obs.mean[vector_idx]);
+		for(size_t i = 0; i < obs.rebinning_means.size(); i++) {
+			size_t vector_idx = i % obs.mean.size();
+			obs.rebinning_means[i] /= obs.rebinning_bin_length;
 
-				if(obs_meta.current_rebin_filling >= obs.rebinning_bin_length) {
-					obs.rebinning_means[rebin_idx] /= obs.rebinning_bin_length;
-
-					double diff = obs.rebinning_means[rebin_idx] - obs.mean[vector_idx];
-					obs.error[vector_idx] += diff * diff;
-
-					if(vector_idx == vector_length - 1) {
-						obs_meta.current_rebin++;
-						obs_meta.current_rebin_filling = 0;
-					}
-				}
-
-				if(vector_idx == vector_length - 1) {
-					metadata[obs_name].sample_counter++;
-				}
-			}
+			double diff = obs.rebinning_means[i] - obs.mean[vector_idx];
+			obs.error[vector_idx] += diff * diff;
 		}
+
+		// autocorrelation_time holds the naive no-rebinning error for now
+		obs.autocorrelation_time = acc.squared_deviations;
 	}
 
-	for(auto &[obs_name, obs] : res.observables) {
-		assert(metadata[obs_name].current_rebin == obs.rebinning_bin_count);
+	for(size_t w = rank_begin; w < rank_end; w++) {
+		auto &obs = *work[w].first;
 		for(size_t i = 0; i < obs.error.size(); i++) {
 			size_t used_samples = obs.rebinning_bin_count * obs.rebinning_bin_length;
 			double no_rebinning_error =
@@ -219,6 +861,46 @@ results merge(const std::vector<std::filesystem::path> &filenames, size_t rebinn
 
 			obs.autocorrelation_time[i] = 0.5 * pow(obs.error[i] / no_rebinning_error, 2);
 		}
+		if(fft_autocorrelation && !fft_autocorrelation_times[w].empty()) {
+			obs.autocorrelation_time = fft_autocorrelation_times[w];
+		}
+	}
+
+	// everything else is the same on all ranks.
+	auto result_vectors = [](observable_result &obs) {
+		return std::array{&obs.mean, &obs.error, &obs.autocorrelation_time, &obs.rebinning_means};
+	};
+	for(int r = 1; r < size; r++) {
+		size_t begin = split(0, work.size(), r, size);
+		size_t end = split(0, work.size(), r + 1, size);
+		if(rank != 0 && rank != r) {
+			continue;
+		}
+
+		std::vector<double> buf;
+		for(size_t w = begin; w < end; w++) {
+			for(auto *v : result_vectors(*work[w].first)) {
+				if(rank == r) {
+					buf.insert(buf.end(), v->begin(), v->end());
+				} else {
+					buf.resize(buf.size() + v->size());
+				}
+			}
+		}
+
+		if(rank == r) {
+			MPI_Send(buf.data(), buf.size(), MPI_DOUBLE, 0, 0, comm);
+			continue;
+		}
+
+		MPI_Recv(buf.data(), buf.size(), MPI_DOUBLE, r, 0, comm, MPI_STATUS_IGNORE);
+		auto it = buf.begin();
+		for(size_t w = begin; w < end; w++) {
+			for(auto *v : result_vectors(*work[w].first)) {
+				std::copy(it, it + v->size(), v->begin());
+				it += v->size();
+			}
+		}
 	}
 
 	return res;
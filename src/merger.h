@@ -3,10 +3,28 @@
 #include "evalable.h"
 #include "results.h"
 #include <filesystem>
+#include <mpi.h>
 
 namespace loadl {
 
 // if rebinning_bin_length is 0, cbrt(total_sample_count) is used as default.
+// The observables are split between threads, which does not change the results. File access
+// takes iodump::mutex. If comm is given, they are also split between its ranks and only rank 0
+// gets the complete results.
+//
+// If cache_filename is given, the state of the merge is kept there and the next merge only reads
+// the bins added since, as long as that does not change the results. It is ignored with comm.
+//
+// If fft_autocorrelation is set, the autocorrelation times are integrated from the normalized
+// autocorrelation function of the bins instead of being estimated from the rebinning error.
 results merge(const std::vector<std::filesystem::path> &filenames, size_t rebinning_bin_length = 0,
-              size_t skip = 0);
+              size_t skip = 0, unsigned threads = 1, MPI_Comm comm = MPI_COMM_NULL,
+              const std::filesystem::path &cache_filename = {}, bool fft_autocorrelation = false);
+
+// true if the merge cache was written for exactly these files in their current state and with the
+// same options.
+bool merge_cache_is_current(const std::filesystem::path &cache_filename,
+                            const std::vector<std::filesystem::path> &filenames,
+                            size_t rebinning_bin_length, size_t skip,
+                            bool fft_autocorrelation = false);
 }
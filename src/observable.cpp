@@ -1,18 +1,66 @@
 #include "observable.h"
+#include <algorithm>
 #include <mpi.h>
 namespace loadl {
 
 observable::observable(std::string name, size_t bin_length, size_t vector_length)
     : name_{std::move(name)}, bin_length_{bin_length}, vector_length_{vector_length} {
-	samples_.reserve(vector_length_ * initial_bin_length);
+	samples_.reserve(initial_capacity(vector_length_));
 	samples_.resize(vector_length_);
 }
 
+size_t observable::initial_capacity(size_t vector_length) {
+	return std::max(vector_length,
+	                std::min(vector_length * initial_bin_length, max_initial_reserve));
+}
+
+size_t observable::completed_bytes() const {
+	return current_bin_ * vector_length_ * sizeof(double);
+}
+
+void observable::track_buffered_bytes(size_t *total) {
+	buffered_bytes_total_ = total;
+	*buffered_bytes_total_ += completed_bytes();
+}
+
 const std::string &observable::name() const {
 	return name_;
 }
 
+size_t observable::bin_length() const {
+	return bin_length_;
+}
+
+size_t observable::vector_length() const {
+	return vector_length_;
+}
+
+size_t observable::completed_bins() const {
+	return current_bin_;
+}
+
+size_t observable::current_bin_filling() const {
+	return current_bin_filling_;
+}
+
+size_t observable::meas_file_extent() const {
+	return meas_file_extent_;
+}
+
+void observable::set_meas_file_extent(size_t extent) {
+	meas_file_extent_ = extent;
+}
+
 void observable::checkpoint_write(const iodump::group &dump_file) const {
+	auto state = get_checkpoint_state();
+	dump_file.write("vector_length", state.vector_length);
+	dump_file.write("bin_length", state.bin_length);
+	dump_file.write("current_bin_filling", state.current_bin_filling);
+	dump_file.write("meas_file_extent", state.meas_file_extent);
+	dump_file.write("samples", state.samples);
+}
+
+observable::checkpoint_state observable::get_checkpoint_state() const {
 	// The plan is that before checkpointing, all complete bins are written to the measurement file.
 	// Then only the incomplete bin remains and we write that into the dump to resume
 	// the filling process next time.
@@ -22,59 +70,230 @@ void observable::checkpoint_write(const iodump::group &dump_file) const {
 	// Another sanity check: the samples_ array should contain one partial bin.
 	assert(samples_.size() == vector_length_);
 
-	dump_file.write("vector_length", vector_length_);
-	dump_file.write("bin_length", bin_length_);
-	dump_file.write("current_bin_filling", current_bin_filling_);
-	dump_file.write("samples", samples_);
+	return {vector_length_, bin_length_, current_bin_filling_, meas_file_extent_, samples_};
 }
 
-void observable::measurement_write(const iodump::group &meas_file) {
+std::vector<double> observable::take_completed_bins() {
+	if(buffered_bytes_total_) {
+		*buffered_bytes_total_ -= completed_bytes();
+	}
+
+	std::vector<double> bins;
 	if(samples_.size() > vector_length_) {
 		std::vector<double> current_bin_value(samples_.end() - vector_length_, samples_.end());
 
 		samples_.resize(current_bin_ * vector_length_);
-		meas_file.insert_back("samples", samples_);
+		bins = std::move(samples_);
 		samples_ = current_bin_value;
 		assert(samples_.size() == vector_length_);
-	} else {
-		meas_file.insert_back("samples", std::vector<double>()); // just touch
 	}
 
+	current_bin_ = 0;
+	return bins;
+}
+
+void observable::measurement_write(const iodump::group &meas_file, size_t max_bins) {
+	// an empty append just creates the dataset.
+	file_samples_append(meas_file, take_completed_bins());
+
 	meas_file.write("vector_length", vector_length_);
 	meas_file.write("bin_length", bin_length_);
+	meas_file_extent_ = file_samples_size(meas_file);
 
-	current_bin_ = 0;
+	while(max_bins > 0 && vector_length_ > 0 && meas_file_extent_ / vector_length_ > max_bins) {
+		double_bin_length(meas_file);
+	}
+}
+
+bool observable::measurement_fits(const iodump::group &meas_file, size_t max_bins) const {
+	size_t count = current_bin_ * vector_length_;
+	if(!file_samples_fit(meas_file, count)) {
+		return false;
+	}
+	return max_bins == 0 || vector_length_ == 0 ||
+	       (file_samples_size(meas_file) + count) / vector_length_ <= max_bins;
+}
+
+size_t observable::file_samples_size(const iodump::group &meas_file) {
+	if(meas_file.exists("samples_size")) {
+		size_t size;
+		meas_file.read("samples_size", size);
+		return size;
+	}
+	auto layout = current_file_layout(meas_file);
+	return meas_file.exists(layout.samples) ? meas_file.get_extent(layout.samples) : 0;
+}
+
+bool observable::file_samples_fit(const iodump::group &meas_file, size_t count) {
+	return meas_file.exists("samples_size") &&
+	       file_samples_size(meas_file) + count <= meas_file.get_extent("samples");
+}
+
+void observable::file_samples_append(const iodump::group &meas_file,
+                                     const std::vector<double> &data, size_t row_length) {
+	size_t size = file_samples_size(meas_file);
+	if(meas_file.exists("samples") && !meas_file.exists("samples_size")) {
+		// written by an older version without room to grow.
+		std::vector<double> old_data;
+		meas_file.read("samples", old_data);
+		meas_file.remove("samples");
+		meas_file.reserve<double>("samples", size + data.size(), row_length);
+		meas_file.write_at("samples", old_data, 0);
+	}
+
+	meas_file.reserve<double>("samples", size + data.size(), row_length);
+	meas_file.write_at("samples", data, row_length == 0 ? size : size / row_length);
+	meas_file.write("samples_size", size + data.size());
+}
+
+void observable::file_samples_truncate(const iodump::group &meas_file, size_t size) {
+	if(meas_file.exists("samples_size")) {
+		meas_file.write("samples_size", size);
+	} else {
+		meas_file.truncate("samples", size);
+	}
+}
+
+static const std::string doubling_group = "doubling";
+
+observable::file_layout observable::current_file_layout(const iodump::group &meas_file) {
+	if(!meas_file.exists(doubling_group)) {
+		return {"samples", "bin_length"};
+	}
+
+	auto doubling = meas_file.open_group(doubling_group);
+	bool new_samples_moved = !doubling.exists("samples");
+	if(!doubling.exists("bin_length") || (!new_samples_moved && meas_file.exists("samples"))) {
+		return {"samples", "bin_length"};
+	}
+	return {new_samples_moved ? "samples" : doubling_group + "/samples",
+	        doubling_group + "/bin_length"};
+}
+
+void observable::repair_file_layout(const iodump::group &meas_file) {
+	if(!meas_file.exists(doubling_group)) {
+		return;
+	}
+
+	auto layout = current_file_layout(meas_file);
+	if(layout.bin_length != "bin_length") {
+		if(layout.samples != "samples") {
+			meas_file.move(layout.samples, "samples");
+		}
+		size_t bin_length;
+		meas_file.read(layout.bin_length, bin_length);
+		meas_file.write("bin_length", bin_length);
+	}
+	meas_file.remove(doubling_group);
+}
+
+void observable::double_bin_length(const iodump::group &meas_file) {
+	std::vector<double> bins;
+	meas_file.read_range("samples", bins, 0, file_samples_size(meas_file));
+	size_t bin_count = bins.size() / vector_length_;
+
+	for(size_t i = 0; i < bin_count / 2; i++) {
+		for(size_t j = 0; j < vector_length_; j++) {
+			bins[i * vector_length_ + j] = (bins[2 * i * vector_length_ + j] +
+			                                bins[(2 * i + 1) * vector_length_ + j]) /
+			                               2;
+		}
+	}
+
+	// a leftover bin goes back into the partial bin, which holds a sum, not a mean.
+	if(bin_count % 2 == 1) {
+		for(size_t j = 0; j < vector_length_; j++) {
+			samples_[j] += bins[(bin_count - 1) * vector_length_ + j] * bin_length_;
+		}
+		current_bin_filling_ += bin_length_;
+	}
+
+	bins.resize(bin_count / 2 * vector_length_);
+	bin_length_ *= 2;
+
+	// This overwrites the old bins, which is only safe because mc::measurements_write does it on
+	// a copy of the measurement file.
+	meas_file.write_at("samples", bins, 0);
+	meas_file.write("samples_size", bins.size());
+	meas_file.write("bin_length", bin_length_);
+	meas_file_extent_ = bins.size();
+}
+
+void observable::measurement_truncate(const iodump::group &meas_file) {
+	size_t extent = meas_file_extent_;
+
+	// If the bins were merged after the checkpoint, we keep the merged bins that only contain
+	// samples we know about. The last few known bins may have been merged with newer ones and
+	// are lost, which does not bias anything.
+	size_t file_bin_length;
+	meas_file.read("bin_length", file_bin_length);
+	if(file_bin_length > bin_length_ && vector_length_ > 0) {
+		extent = extent / vector_length_ / (file_bin_length / bin_length_) * vector_length_;
+		bin_length_ = file_bin_length;
+	}
+
+	size_t size = file_samples_size(meas_file);
+	if(size < extent) {
+		throw std::runtime_error{fmt::format(
+		    "observable '{}': the measurement file has {} values, but the checkpoint expects {}. "
+		    "It was damaged or modified.",
+		    name_, size, extent)};
+	}
+	if(size > extent) {
+		file_samples_truncate(meas_file, extent);
+	}
+
+	meas_file_extent_ = extent;
 }
 
 observable observable::checkpoint_read(const std::string &name, const iodump::group &d) {
-	size_t vector_length, bin_length;
-	d.read("vector_length", vector_length);
-	d.read("bin_length", bin_length);
+	checkpoint_state state;
+	d.read("vector_length", state.vector_length);
+	d.read("bin_length", state.bin_length);
+	d.read("current_bin_filling", state.current_bin_filling);
+	// dumps from older versions do not have it
+	if(d.exists("meas_file_extent")) {
+		d.read("meas_file_extent", state.meas_file_extent);
+	}
+	d.read("samples", state.samples);
+	return checkpoint_read(name, state);
+}
 
-	observable obs{name, bin_length, vector_length};
-	d.read("current_bin_filling", obs.current_bin_filling_);
-	d.read("samples", obs.samples_);
+observable observable::checkpoint_read(const std::string &name, const checkpoint_state &state) {
+	observable obs{name, state.bin_length, state.vector_length};
+	obs.current_bin_filling_ = state.current_bin_filling;
+	obs.meas_file_extent_ = state.meas_file_extent;
+	// keeps the capacity reserved by the constructor.
+	obs.samples_.assign(state.samples.begin(), state.samples.end());
 	return obs;
 }
 
 void observable::mpi_sendrecv(int target_rank) {
-	const int msg_size = 4;
+	const int msg_size = 5;
 	int rank;
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	if(buffered_bytes_total_) {
+		*buffered_bytes_total_ -= completed_bytes();
+	}
 
-	unsigned long msg[msg_size] = {current_bin_, vector_length_, bin_length_, current_bin_filling_};
+	unsigned long msg[msg_size] = {current_bin_, vector_length_, bin_length_, current_bin_filling_,
+	                               meas_file_extent_};
 	MPI_Sendrecv_replace(msg, msg_size, MPI_UNSIGNED_LONG, target_rank, 0, target_rank, 0,
 	                     MPI_COMM_WORLD, MPI_STATUS_IGNORE);
 	current_bin_ = msg[0];
 	vector_length_ = msg[1];
 	bin_length_ = msg[2];
 	current_bin_filling_ = msg[3];
+	meas_file_extent_ = msg[4];
 
 	std::vector<double> recvbuf((current_bin_ + 1) * vector_length_);
 	MPI_Sendrecv(samples_.data(), samples_.size(), MPI_DOUBLE, target_rank, 0, recvbuf.data(),
 	             recvbuf.size(), MPI_DOUBLE, target_rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
 
 	samples_ = recvbuf;
+	if(buffered_bytes_total_) {
+		*buffered_bytes_total_ += completed_bytes();
+	}
 }
 
 }
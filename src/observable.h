@@ -1,6 +1,8 @@
 #pragma once
 
 #include "iodump.h"
+#include <array>
+#include <cassert>
 #include <cmath>
 #include <map>
 #include <string>
@@ -13,6 +15,18 @@ public:
 	observable(std::string name, size_t bin_length, size_t vector_length);
 
 	const std::string &name() const;
+	size_t bin_length() const;
+	size_t vector_length() const;
+	size_t completed_bins() const;
+	size_t current_bin_filling() const;
+
+	// From now on, *total is kept up to date with the memory taken by the completed bins that
+	// were not written yet.
+	void track_buffered_bytes(size_t *total);
+
+	// number of doubles in the measurement file as of the last measurement_write.
+	static const size_t unknown_extent = -1;
+	size_t meas_file_extent() const;
 
 	template<class T,
 	         std::enable_if_t<std::is_arithmetic_v<std::remove_reference_t<T>>> * = nullptr>
@@ -21,12 +35,66 @@ public:
 	template<class T>
 	auto add(const T &val) -> decltype(val[0], void());
 
+	// faster version for vectors whose length is known at compile time. Scalars end up here.
+	template<class T, size_t N>
+	void add(const std::array<T, N> &val);
+
 	void checkpoint_write(const iodump::group &dump_file) const;
 
-	// This will empty the cache of already completed bins
-	void measurement_write(const iodump::group &meas_file);
+	// what checkpoint_write stores, so that measurements can store it for many observables in
+	// shared datasets.
+	struct checkpoint_state {
+		size_t vector_length{};
+		size_t bin_length{};
+		size_t current_bin_filling{};
+		size_t meas_file_extent{unknown_extent};
+		std::vector<double> samples; // the partial bin
+	};
+	checkpoint_state get_checkpoint_state() const;
+
+	// This will empty the cache of already completed bins. If max_bins is nonzero and the
+	// measurement file holds more bins than that, adjacent bins are merged and the bin length
+	// doubles.
+	void measurement_write(const iodump::group &meas_file, size_t max_bins = 0);
+	// true if measurement_write would only fill the room that the samples dataset already has
+	// and not double the bin length.
+	bool measurement_fits(const iodump::group &meas_file, size_t max_bins = 0) const;
+
+	// Removes the completed bins from memory and returns them, for when they are written to the
+	// measurement file by someone else. meas_file_extent is set to the number of doubles the
+	// observable then has in the file.
+	std::vector<double> take_completed_bins();
+	void set_meas_file_extent(size_t extent);
+
+	// Drops the samples that were written to the measurement file after the checkpoint we were
+	// read from.
+	void measurement_truncate(const iodump::group &meas_file);
 
 	static observable checkpoint_read(const std::string &name, const iodump::group &dump_file);
+	static observable checkpoint_read(const std::string &name, const checkpoint_state &state);
+
+	// The samples dataset of an observable or observable_pack in the measurement file has room
+	// for more values than it holds. How many it holds is kept in samples_size, so that
+	// appending within that room only writes data and never changes the structure of the file.
+	// Files of older versions have no samples_size and no room.
+	static size_t file_samples_size(const iodump::group &meas_file);
+	// true if count more values can be appended without making room first.
+	static bool file_samples_fit(const iodump::group &meas_file, size_t count);
+	// data holds whole rows of row_length values for observable_packs.
+	static void file_samples_append(const iodump::group &meas_file,
+	                                const std::vector<double> &data, size_t row_length = 0);
+	static void file_samples_truncate(const iodump::group &meas_file, size_t size);
+
+	// Names of the datasets in the measurement file that hold the samples and the bin length.
+	// Older versions doubled the bin length in several steps, and they are only different from
+	// "samples" and "bin_length" if one of those crashed in between.
+	struct file_layout {
+		std::string samples;
+		std::string bin_length;
+	};
+	static file_layout current_file_layout(const iodump::group &meas_file);
+	// Finishes or undoes a doubling of the bin length that was interrupted by a crash.
+	static void repair_file_layout(const iodump::group &meas_file);
 
 	// switch copy with target rank.
 	// useful for parallel tempering mode
@@ -34,16 +102,65 @@ public:
 
 private:
 	static const size_t initial_bin_length = 1000;
+	// upper limit for the memory reserved up front, in doubles.
+	static const size_t max_initial_reserve = 1 << 20;
+	static size_t initial_capacity(size_t vector_length);
 
 	std::string name_;
 	size_t bin_length_{};
 	size_t vector_length_{};
 	size_t current_bin_{};
 	size_t current_bin_filling_{};
+	size_t meas_file_extent_{};
+	size_t *buffered_bytes_total_{};
 
 	std::vector<double> samples_;
+
+	void double_bin_length(const iodump::group &meas_file);
+
+	size_t completed_bytes() const;
+	void check_vector_length(size_t length);
+	void finish_bin();
 };
 
+inline void observable::check_vector_length(size_t length) {
+	if(length == 0) {
+		throw std::runtime_error("observable::add: tried to add zero-length value.");
+	}
+
+	if(vector_length_ == length) {
+		return;
+	}
+
+	if(vector_length_ != 0) {
+		throw std::runtime_error{fmt::format(
+		    "observable::add: added vector has inconsistent size ({}). Observable was "
+		    "initialized with vector length ({})",
+		    length, vector_length_)};
+	}
+
+	// when the variable is manually registered, it can happen that the vector length was
+	// not yet set.
+	vector_length_ = length;
+	assert(samples_.size() == 0);
+	samples_.reserve(initial_capacity(vector_length_));
+	samples_.resize(vector_length_);
+}
+
+inline void observable::finish_bin() {
+	if(bin_length_ > 1) {
+		for(size_t j = 0; j < vector_length_; ++j) {
+			samples_[current_bin_ * vector_length_ + j] /= bin_length_;
+		}
+	}
+	current_bin_++;
+	samples_.resize((current_bin_ + 1) * vector_length_);
+	current_bin_filling_ = 0;
+	if(buffered_bytes_total_) {
+		*buffered_bytes_total_ += vector_length_ * sizeof(double);
+	}
+}
+
 template<class T, std::enable_if_t<std::is_arithmetic_v<std::remove_reference_t<T>>> *>
 void observable::add(T val) {
 	add(std::array<T, 1>{val});
@@ -51,38 +168,30 @@ void observable::add(T val) {
 
 template<class T>
 auto observable::add(const T &val) -> decltype(val[0], void()) {
-	if(val.size() == 0) {
-		throw std::runtime_error("observable::add: tried to add zero-length value.");
-	}
-
-	if(vector_length_ != val.size()) {
-		if(vector_length_ != 0) {
-			throw std::runtime_error{fmt::format(
-			    "observable::add: added vector has inconsistent size ({}). Observable was "
-			    "initialized with vector length ({})",
-			    val.size(), vector_length_)};
-		} else {
-			// when the variable is manually registered, it can happen that the vector length was
-			// not yet set.
-			vector_length_ = val.size();
-			assert(samples_.size() == 0);
-			samples_.resize(vector_length_);
-		}
-	}
+	check_vector_length(val.size());
 
 	for(size_t j = 0; j < vector_length_; ++j)
 		samples_[j + current_bin_ * vector_length_] += static_cast<double>(val[j]);
 	current_bin_filling_++;
 
 	if(current_bin_filling_ == bin_length_) { // need to start a new bin next time
-		if(bin_length_ > 1) {
-			for(size_t j = 0; j < vector_length_; ++j) {
-				samples_[current_bin_ * vector_length_ + j] /= bin_length_;
-			}
-		}
-		current_bin_++;
-		samples_.resize((current_bin_ + 1) * vector_length_);
-		current_bin_filling_ = 0;
+		finish_bin();
+	}
+}
+
+template<class T, size_t N>
+void observable::add(const std::array<T, N> &val) {
+	check_vector_length(N);
+
+	// the fixed trip count lets the compiler unroll and vectorize this loop.
+	double *bin = samples_.data() + current_bin_ * N;
+	for(size_t j = 0; j < N; ++j) {
+		bin[j] += static_cast<double>(val[j]);
+	}
+	current_bin_filling_++;
+
+	if(current_bin_filling_ == bin_length_) {
+		finish_bin();
 	}
 }
 }
@@ -1,4 +1,5 @@
 #include "results.h"
+#include "iodump.h"
 #include <algorithm>
 #include <fstream>
 #include <nlohmann/json.hpp>
@@ -33,4 +34,42 @@ void results::write_json(const std::string &filename, const std::string &taskdir
 	std::ofstream file(filename);
 	file << out.dump(1);
 }
+
+void results::write_hdf5(const std::string &filename, const nlohmann::json &params) const {
+	iodump file = iodump::create(filename);
+	auto root = file.get_root();
+	root.write("parameters", params.dump());
+
+	auto obs_group = root.open_group("observables");
+	for(auto &[obs_name, obs] : observables) {
+		auto g = obs_group.open_group(obs_name);
+		g.write("rebinning_bin_length", obs.rebinning_bin_length);
+		g.write("rebinning_bin_count", obs.rebinning_bin_count);
+		g.write("internal_bin_length", obs.internal_bin_length);
+		g.write("mean", obs.mean);
+		g.write("error", obs.error);
+		g.write("autocorrelation_time", obs.autocorrelation_time);
+	}
+}
+
+results results::read_hdf5(const std::string &filename, std::string &params) {
+	results res;
+	iodump file = iodump::open_readonly(filename);
+	auto root = file.get_root();
+	root.read("parameters", params);
+
+	auto obs_group = root.open_group("observables");
+	for(const auto &obs_name : obs_group) {
+		auto &obs = res.observables[obs_name];
+		auto g = obs_group.open_group(obs_name);
+		obs.name = obs_name;
+		g.read("rebinning_bin_length", obs.rebinning_bin_length);
+		g.read("rebinning_bin_count", obs.rebinning_bin_count);
+		g.read("internal_bin_length", obs.internal_bin_length);
+		g.read("mean", obs.mean);
+		g.read("error", obs.error);
+		g.read("autocorrelation_time", obs.autocorrelation_time);
+	}
+	return res;
+}
 }
@@ -15,16 +15,18 @@ struct observable_result {
 	size_t total_sample_count = 0;
 
 	// This is the bin length that was used when measuring the
-	// samples. If different runs had different internal_bin_lengths,
-	// this value is undefined.
-	//
-	// But it’s just a convenience feature, so that’s not bad.
+	// samples. If runs had different internal_bin_lengths because of adaptive binning,
+	// the shorter bins were averaged to the longest one, which is stored here.
 	size_t internal_bin_length = 0;
 
 	std::vector<double> mean;
 	std::vector<double> error;
 
 	std::vector<double> autocorrelation_time;
+
+	// only for evalables: the evaluations on the rebinning_bin_count jackknife samples,
+	// followed by the one on the complete dataset.
+	std::vector<double> jackknife_samples;
 };
 
 // results holds the means and errors merged from all the runs belonging to a task
@@ -35,5 +37,10 @@ struct results {
 	// writes out the results in a json file.
 	void write_json(const std::string &filename, const std::string &taskdir,
 	                const nlohmann::json &params);
+
+	// writes the same in an HDF5 file, with the parameters as a json string.
+	void write_hdf5(const std::string &filename, const nlohmann::json &params) const;
+	// reads what write_hdf5 wrote. The rebinning_means are not part of it.
+	static results read_hdf5(const std::string &filename, std::string &params);
 };
 }
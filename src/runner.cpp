@@ -2,7 +2,13 @@
 #include "iodump.h"
 #include "merger.h"
 #include "runner_pt.h"
+#include <chrono>
 #include <fmt/format.h>
+#include <utility>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 namespace loadl {
 
 enum {
@@ -10,10 +16,16 @@ enum {
 	T_STATUS = 1,
 	T_ACTION = 2,
 	T_NEW_JOB = 3,
+	T_LEASE = 4,
+	T_IO_GRANT = 5,
 
 	S_IDLE = 1,
 	S_BUSY = 2,
 	S_TIMEUP = 3,
+	S_SUBMASTER_DONE = 4,
+	S_IO_REQUEST = 5,
+	S_IO_DONE = 6,
+	S_MERGED = 7,
 
 	A_EXIT = 1,
 	A_CONTINUE = 2,
@@ -21,51 +33,225 @@ enum {
 	A_PROCESS_DATA_NEW_JOB = 4,
 };
 
+// The cores this process may run on. On nodes restricted by cpusets, these are not simply the
+// first hardware_concurrency() cores.
+static std::vector<int> allowed_cores() {
+	std::vector<int> cores;
+#ifdef __linux__
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	if(sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+		for(int core = 0; core < CPU_SETSIZE; core++) {
+			if(CPU_ISSET(core, &cpuset)) {
+				cores.push_back(core);
+			}
+		}
+	}
+#endif
+	if(cores.empty()) {
+		for(unsigned core = 0; core < std::max(1U, std::thread::hardware_concurrency()); core++) {
+			cores.push_back(core);
+		}
+	}
+	return cores;
+}
+
+// Decides which cores the threads of this rank are pinned to. This is collective over
+// MPI_COMM_WORLD because it needs to know which ranks share a node.
+static std::vector<int> thread_cores(jobinfo &job) {
+	auto jobconfig = job.jobfile["jobconfig"];
+	int threads = jobconfig.get<int>("mc_threads_per_rank", 1);
+	std::string pinning = jobconfig.get<std::string>("mc_thread_pinning", "none");
+	if(pinning == "none") {
+		return {};
+	}
+
+	MPI_Comm node_comm;
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+	int node_rank, node_size;
+	MPI_Comm_rank(node_comm, &node_rank);
+	MPI_Comm_size(node_comm, &node_size);
+	MPI_Comm_free(&node_comm);
+
+	// oversubscribed nodes wrap around
+	std::vector<int> allowed = allowed_cores();
+	int ncores = allowed.size();
+	std::vector<int> cores(threads);
+	for(int i = 0; i < threads; i++) {
+		if(pinning == "compact") {
+			cores[i] = allowed[(node_rank * threads + i) % ncores];
+		} else if(pinning == "scatter") {
+			cores[i] = allowed[(i * node_size + node_rank) % ncores];
+		} else {
+			throw std::runtime_error{fmt::format(
+			    "unknown mc_thread_pinning '{}'. Use 'none', 'compact' or 'scatter'.", pinning)};
+		}
+	}
+	return cores;
+}
+
+static void pin_thread(int core) {
+#ifdef __linux__
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(core, &cpuset);
+	if(pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0) {
+		throw std::runtime_error{fmt::format("could not pin thread to core {}", core)};
+	}
+#else
+	(void)core;
+	throw std::runtime_error{"mc_thread_pinning is only supported on Linux"};
+#endif
+}
+
 int runner_mpi_start(jobinfo job, const mc_factory &mccreator, int argc, char **argv) {
 	if(job.jobfile["jobconfig"].defined("parallel_tempering_parameter")) {
 		runner_pt_start(std::move(job), mccreator, argc, argv);
 		return 0;
 	}
 
-	MPI_Init(&argc, &argv);
+	// worker, merge and checkpoint threads never call MPI themselves.
+	int provided;
+	MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+	if(provided < MPI_THREAD_FUNNELED) {
+		throw std::runtime_error{
+		    "the MPI library does not support MPI_THREAD_FUNNELED, which is needed because "
+		    "loadleveller runs threads next to MPI."};
+	}
 
 	int rank;
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 	int rc = 0;
 
-	if(rank == 0) {
-		runner_master r{std::move(job)};
-		rc = r.start();
+	// number of ranks (including the sub-master) that share one sub-master.
+	int group_size = job.jobfile["jobconfig"].get<int>("mc_submaster_group_size", 0);
+	bool master_does_work = job.jobfile["jobconfig"].get<bool>("mc_master_does_work", false);
+	std::vector<int> cores = thread_cores(job);
+
+	if(group_size > 1) {
+		MPI_Comm group_comm;
+		MPI_Comm_split(MPI_COMM_WORLD, rank == 0 ? MPI_UNDEFINED : (rank - 1) / group_size, rank,
+		               &group_comm);
+
+		if(rank == 0) {
+			runner_top_master r{job};
+			rc = r.start();
+		} else {
+			int group_rank;
+			MPI_Comm_rank(group_comm, &group_rank);
+			if(group_rank == 0) {
+				runner_master r{job, group_comm, true};
+				if(master_does_work) {
+					runner_slave s{std::move(job), mccreator, group_comm, cores};
+					r.start(&s);
+				} else {
+					r.start();
+				}
+			} else {
+				runner_slave r{std::move(job), mccreator, group_comm, cores};
+				r.start();
+			}
+			MPI_Comm_free(&group_comm);
+		}
+	} else if(rank == 0) {
+		runner_master r{job};
+		if(master_does_work) {
+			runner_slave s{job, mccreator, MPI_COMM_WORLD, cores};
+			rc = r.start(&s);
+		} else {
+			rc = r.start();
+		}
 	} else {
-		runner_slave r{std::move(job), mccreator};
+		runner_slave r{std::move(job), mccreator, MPI_COMM_WORLD, cores};
 		r.start();
 	}
 
+	// all merges are done after the barrier. The master already kept the HDF5 job results up to
+	// date while tasks finished, but merges in the background may have come after that.
 	MPI_Barrier(MPI_COMM_WORLD);
+	if(rank == 0) {
+		job.concatenate_results();
+	}
 	MPI_Finalize();
 
 	return rc;
 }
 
-runner_master::runner_master(jobinfo job) : job_{std::move(job)} {}
+runner_master::runner_master(jobinfo job, MPI_Comm comm, bool is_submaster)
+    : job_{std::move(job)}, comm_{comm}, is_submaster_{is_submaster} {}
+
+int runner_master::start(runner_slave *local_slave) {
+	MPI_Comm_size(comm_, &num_active_ranks_);
+	runs_per_rank_ = job_.jobfile["jobconfig"].get<int>("mc_threads_per_rank", 1);
+	io_limit_ = job_.jobfile["jobconfig"].get<int>("mc_io_concurrency", 0);
+	if(is_submaster_ && io_limit_ > 0) {
+		// every sub-master gets an equal share of the limit.
+		int world_size;
+		MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+		int group_size = job_.jobfile["jobconfig"].get<int>("mc_submaster_group_size");
+		int submasters = (world_size - 1 + group_size - 1) / group_size;
+		io_limit_ = std::max(1, io_limit_ / submasters);
+	}
+	if(local_slave) {
+		num_active_ranks_++;
+	}
 
-int runner_master::start() {
-	MPI_Comm_size(MPI_COMM_WORLD, &num_active_ranks_);
+	if(is_submaster_) {
+		// tasks we do not own are marked as done. They are filled in by lease_task().
+		tasks_.assign(job_.task_names.size(), runner_task{0, 0, 0});
+	} else {
+		job_.log(fmt::format("Starting job '{}'", job_.jobname));
+		read();
+	}
 
-	job_.log(fmt::format("Starting job '{}'", job_.jobname));
-	read();
+	if(local_slave) {
+		local_slave->start([this]() { poll(); });
+	}
 
-	while(num_active_ranks_ > 1) {
+	// ranks that exit while merging in the background still report when they are done.
+	while(num_active_ranks_ > 1 || pending_merges_ > 0) {
 		react();
 	}
 
+	if(io_limit_ > 0) {
+		job_.log(fmt::format("master: I/O throttling delayed {} requests by {:.1f}s in total",
+		                     io_delayed_requests_, io_wait_time_));
+	}
+
 	bool all_done = current_task_id_ < 0;
-	job_.log(fmt::format("master: stopping due to {}", all_done ? "completion" : "time limit"));
+	if(is_submaster_) {
+		int msg[2] = {S_SUBMASTER_DONE, all_done};
+		MPI_Send(msg, sizeof(msg) / sizeof(msg[0]), MPI_INT, MASTER, T_STATUS, MPI_COMM_WORLD);
+		return !all_done;
+	}
+	const char *reason = all_done ? "completion" : "time limit";
+	if(!all_done && jobinfo::stop_signal_received()) {
+		reason = "stop signal";
+	}
+	job_.log(fmt::format("master: stopping due to {}", reason));
 
 	return !all_done;
 }
 
+// Asks the top-level master for a task nobody works on yet. Returns -1 if there is none left.
+int runner_master::lease_task() {
+	int msg[2] = {S_IDLE, 0};
+	MPI_Send(msg, sizeof(msg) / sizeof(msg[0]), MPI_INT, MASTER, T_STATUS, MPI_COMM_WORLD);
+
+	int64_t lease[3];
+	MPI_Recv(lease, sizeof(lease) / sizeof(lease[0]), MPI_INT64_T, MASTER, T_LEASE,
+	         MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	int task_id = lease[0];
+	if(task_id >= 0) {
+		tasks_[task_id] =
+		    runner_task{static_cast<size_t>(lease[1]), static_cast<size_t>(lease[2]), 0};
+	}
+	return task_id;
+}
+
 int runner_master::get_new_task_id(int old_id) {
+	// sub-masters only see the tasks they leased, so this hands out those first. Only when all
+	// of them are done is the top-level master asked for another.
 	int ntasks = tasks_.size();
 	int i;
 	for(i = 1; i <= ntasks; i++) {
@@ -73,14 +259,31 @@ int runner_master::get_new_task_id(int old_id) {
 			return (old_id + i) % ntasks;
 	}
 
+	if(is_submaster_ && !leases_exhausted_) {
+		int task_id = lease_task();
+		if(task_id >= 0) {
+			return task_id;
+		}
+		leases_exhausted_ = true;
+	}
+
 	// everything done!
 	return -1;
 }
 
+void runner_master::poll() {
+	int flag;
+	MPI_Iprobe(MPI_ANY_SOURCE, T_STATUS, comm_, &flag, MPI_STATUS_IGNORE);
+	while(flag) {
+		react();
+		MPI_Iprobe(MPI_ANY_SOURCE, T_STATUS, comm_, &flag, MPI_STATUS_IGNORE);
+	}
+}
+
 void runner_master::react() {
 	int node_status;
 	MPI_Status stat;
-	MPI_Recv(&node_status, 1, MPI_INT, MPI_ANY_SOURCE, T_STATUS, MPI_COMM_WORLD, &stat);
+	MPI_Recv(&node_status, 1, MPI_INT, MPI_ANY_SOURCE, T_STATUS, comm_, &stat);
 	int node = stat.MPI_SOURCE;
 	if(node_status == S_IDLE) {
 		current_task_id_ = get_new_task_id(current_task_id_);
@@ -89,48 +292,81 @@ void runner_master::react() {
 			num_active_ranks_--;
 		} else {
 			send_action(A_NEW_JOB, node);
-			tasks_[current_task_id_].scheduled_runs++;
+			// the rank gets one run for each of its threads.
+			int run_id = tasks_[current_task_id_].scheduled_runs + 1;
+			tasks_[current_task_id_].scheduled_runs += runs_per_rank_;
 
 			size_t sweeps_until_comm =
 			    1 + tasks_[current_task_id_].target_sweeps -
 			    std::min(tasks_[current_task_id_].target_sweeps, tasks_[current_task_id_].sweeps);
 			assert(current_task_id_ >= 0);
 			uint64_t msg[3] = {static_cast<uint64_t>(current_task_id_),
-			                   static_cast<uint64_t>(tasks_[current_task_id_].scheduled_runs),
-			                   sweeps_until_comm};
-			MPI_Send(&msg, sizeof(msg) / sizeof(msg[0]), MPI_UINT64_T, node, T_NEW_JOB,
-			         MPI_COMM_WORLD);
+			                   static_cast<uint64_t>(run_id), sweeps_until_comm};
+			MPI_Send(&msg, sizeof(msg) / sizeof(msg[0]), MPI_UINT64_T, node, T_NEW_JOB, comm_);
 		}
 	} else if(node_status == S_BUSY) {
 		uint64_t msg[2];
-		MPI_Recv(msg, sizeof(msg) / sizeof(msg[0]), MPI_UINT64_T, node, T_STATUS, MPI_COMM_WORLD,
-		         &stat);
+		MPI_Recv(msg, sizeof(msg) / sizeof(msg[0]), MPI_UINT64_T, node, T_STATUS, comm_, &stat);
 		int task_id = msg[0];
 		size_t completed_sweeps = msg[1];
 
 		tasks_[task_id].sweeps += completed_sweeps;
 		if(tasks_[task_id].is_done()) {
-			tasks_[task_id].scheduled_runs--;
+			tasks_[task_id].scheduled_runs -= runs_per_rank_;
 
 			if(tasks_[task_id].scheduled_runs > 0) {
 				job_.log(fmt::format("{} has enough sweeps. Waiting for {} busy ranks.",
-				                     job_.task_names[task_id], tasks_[task_id].scheduled_runs));
+				                     job_.task_names[task_id],
+				                     tasks_[task_id].scheduled_runs / runs_per_rank_));
 				send_action(A_NEW_JOB, node);
 			} else {
 				job_.log(fmt::format("{} is done. Merging.", job_.task_names[task_id]));
 
 				send_action(A_PROCESS_DATA_NEW_JOB, node);
+				pending_merges_++;
 			}
 		} else {
 			send_action(A_CONTINUE, node);
 		}
+	} else if(node_status == S_MERGED) {
+		uint64_t task_id;
+		MPI_Recv(&task_id, 1, MPI_UINT64_T, node, T_STATUS, comm_, &stat);
+		pending_merges_--;
+		if(is_submaster_) {
+			int msg[2] = {S_MERGED, static_cast<int>(task_id)};
+			MPI_Send(msg, sizeof(msg) / sizeof(msg[0]), MPI_INT, MASTER, T_STATUS,
+			         MPI_COMM_WORLD);
+		} else {
+			job_.update_task_results(task_id);
+		}
+	} else if(node_status == S_IO_REQUEST) {
+		if(io_limit_ <= 0 || io_active_ < io_limit_) {
+			grant_io(node);
+		} else {
+			io_queue_.emplace_back(node, MPI_Wtime());
+		}
+	} else if(node_status == S_IO_DONE) {
+		io_active_--;
+		if(!io_queue_.empty()) {
+			auto [waiting_node, time_requested] = io_queue_.front();
+			io_queue_.pop_front();
+			io_wait_time_ += MPI_Wtime() - time_requested;
+			io_delayed_requests_++;
+			grant_io(waiting_node);
+		}
 	} else { // S_TIMEUP
 		num_active_ranks_--;
 	}
 }
 
+void runner_master::grant_io(int node) {
+	io_active_++;
+	int grant = 1;
+	MPI_Send(&grant, 1, MPI_INT, node, T_IO_GRANT, comm_);
+}
+
 void runner_master::send_action(int action, int destination) {
-	MPI_Send(&action, 1, MPI_INT, destination, T_ACTION, MPI_COMM_WORLD);
+	MPI_Send(&action, 1, MPI_INT, destination, T_ACTION, comm_);
 }
 
 void runner_master::read() {
@@ -145,82 +381,222 @@ void runner_master::read() {
 	}
 }
 
-runner_slave::runner_slave(jobinfo job, mc_factory mccreator)
-    : job_{std::move(job)}, mccreator_{std::move(mccreator)} {}
+runner_top_master::runner_top_master(jobinfo job) : job_{std::move(job)} {}
+
+int runner_top_master::start() {
+	MPI_Comm_size(MPI_COMM_WORLD, &num_active_submasters_);
+	int group_size = job_.jobfile["jobconfig"].get<int>("mc_submaster_group_size");
+	num_active_submasters_ = (num_active_submasters_ - 1 + group_size - 1) / group_size;
+
+	job_.log(fmt::format("Starting job '{}' with {} sub-masters", job_.jobname,
+	                     num_active_submasters_));
+	read();
+
+	while(num_active_submasters_ > 0) {
+		react();
+	}
+
+	// leased tasks are done if the sub-master that owned them says so.
+	bool all_done = submasters_done_;
+	for(auto &task : tasks_) {
+		all_done = all_done && (task.is_done() || task.scheduled_runs > 0);
+	}
+	const char *reason = all_done ? "completion" : "time limit";
+	if(!all_done && jobinfo::stop_signal_received()) {
+		reason = "stop signal";
+	}
+	job_.log(fmt::format("master: stopping due to {}", reason));
+
+	return !all_done;
+}
+
+void runner_top_master::react() {
+	int msg[2];
+	MPI_Status stat;
+	MPI_Recv(msg, sizeof(msg) / sizeof(msg[0]), MPI_INT, MPI_ANY_SOURCE, T_STATUS,
+	         MPI_COMM_WORLD, &stat);
+	int submaster = stat.MPI_SOURCE;
+
+	if(msg[0] == S_IDLE) {
+		int64_t lease[3] = {-1, 0, 0};
+
+		int ntasks = tasks_.size();
+		for(int i = 1; i <= ntasks; i++) {
+			int task_id = (current_task_id_ + i) % ntasks;
+			if(!tasks_[task_id].is_done() && tasks_[task_id].scheduled_runs == 0) {
+				current_task_id_ = task_id;
+				tasks_[task_id].scheduled_runs = 1;
+				lease[0] = task_id;
+				lease[1] = tasks_[task_id].target_sweeps;
+				lease[2] = tasks_[task_id].sweeps;
+				break;
+			}
+		}
+		MPI_Send(lease, sizeof(lease) / sizeof(lease[0]), MPI_INT64_T, submaster, T_LEASE,
+		         MPI_COMM_WORLD);
+	} else if(msg[0] == S_MERGED) {
+		job_.update_task_results(msg[1]);
+	} else { // S_SUBMASTER_DONE
+		submasters_done_ = submasters_done_ && msg[1];
+		num_active_submasters_--;
+	}
+}
+
+void runner_top_master::read() {
+	for(size_t i = 0; i < job_.task_names.size(); i++) {
+		auto task = job_.jobfile["tasks"][job_.task_names[i]];
+
+		size_t target_sweeps = task.get<size_t>("sweeps");
+		size_t sweeps = job_.read_dump_progress(i);
+
+		tasks_.emplace_back(target_sweeps, sweeps, 0);
+	}
+}
+
+runner_slave::runner_slave(jobinfo job, mc_factory mccreator, MPI_Comm comm,
+                           std::vector<int> thread_cores)
+    : job_{std::move(job)}, comm_{comm}, mccreator_{std::move(mccreator)},
+      thread_cores_{std::move(thread_cores)} {}
 
-void runner_slave::start() {
+void runner_slave::start(std::function<void()> poll_master) {
+	poll_master_ = std::move(poll_master);
 	MPI_Comm_rank(MPI_COMM_WORLD, &rank_);
 	time_start_ = MPI_Wtime();
 	time_last_checkpoint_ = time_start_;
+	overlap_communication_ =
+	    job_.jobfile["jobconfig"].get<bool>("mc_overlap_communication", false);
+	threads_ = job_.jobfile["jobconfig"].get<int>("mc_threads_per_rank", 1);
+	background_merge_ = job_.jobfile["jobconfig"].get<bool>("mc_background_merge", false);
+	async_checkpoint_ = job_.jobfile["jobconfig"].get<bool>("mc_async_checkpoint", false);
+	io_throttled_ = job_.jobfile["jobconfig"].get<int>("mc_io_concurrency", 0) > 0;
+	worker_errors_.resize(threads_);
+	if(!thread_cores_.empty()) {
+		pin_thread(thread_cores_[0]);
+	}
 
 	int action = what_is_next(S_IDLE);
 	while(action != A_EXIT) {
 		if(action == A_NEW_JOB) {
-			sys_ =
-			    std::unique_ptr<mc>{mccreator_(job_.jobfile["tasks"][job_.task_names[task_id_]])};
-			if(!sys_->_read(job_.rundir(task_id_, run_id_))) {
-				sys_->_init();
-				job_.log(fmt::format("* initialized {}", job_.rundir(task_id_, run_id_).string()));
+			bool initialized = false;
+			checkpoint_finalize();
+			sys_.clear();
+			std::unique_lock<std::recursive_mutex> lock{hdf5_mutex_};
+			acquire_io();
+			// the instances are checkpointed one after another, so their costs add up.
+			checkpoint_cost_ = 0;
+			for(int i = 0; i < threads_; i++) {
+				sys_.emplace_back(mccreator_(job_.jobfile["tasks"][job_.task_names[task_id_]]));
+				std::string rundir = job_.rundir(task_id_, run_id_ + i);
+				if(!sys_[i]->_read(rundir)) {
+					sys_[i]->_init();
+					job_.log(fmt::format("* initialized {}", rundir));
+					initialized = true;
+				} else {
+					job_.log(fmt::format("* read {}", rundir));
+					checkpoint_cost_ += sys_[i]->checkpoint_write_time();
+				}
+			}
+			release_io();
+			lock.unlock();
+			if(initialized) {
 				checkpoint_write();
-			} else {
-				job_.log(fmt::format("* read {}", job_.rundir(task_id_, run_id_).string()));
 			}
 		} else {
-			if(!sys_) {
+			if(sys_.empty()) {
 				throw std::runtime_error(
 				    "slave got A_CONTINUE even though there is no job to be continued");
 			}
 		}
 
-		while(sweeps_since_last_query_ < sweeps_before_communication_) {
-			sys_->_do_update();
+		start_workers();
+		while(sweeps_since_last_query_ + worker_sweeps_ < sweeps_before_communication_) {
+			sys_[0]->_do_update();
 
-			if(sys_->is_thermalized()) {
-				sys_->_do_measurement();
+			if(sys_[0]->is_thermalized()) {
+				sys_[0]->_do_measurement();
 				sweeps_since_last_query_++;
+				sweeps_done_.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			if(poll_master_) {
+				poll_master_();
 			}
 
-			if(is_checkpoint_time() || time_is_up()) {
+			if(is_checkpoint_time() || time_is_up() || action_arrived() || stop_workers_) {
 				break;
 			}
 		}
+		stop_workers();
 		checkpoint_write();
 
 		if(time_is_up()) {
+			if(query_pending_ && wait_pending_action() == A_PROCESS_DATA_NEW_JOB) {
+				merge_measurements();
+			}
 			what_is_next(S_TIMEUP);
-			job_.log(fmt::format("rank {} exits: time up", rank_));
+			job_.log(fmt::format("rank {} exits: {}", rank_,
+			                     jobinfo::stop_signal_received() ? "stop signal" : "time up"));
 			break;
 		}
 
 		action = what_is_next(S_BUSY);
 	}
 
+	checkpoint_finalize();
+	report_merge(true);
+
 	if(action == A_EXIT) {
 		job_.log(fmt::format("rank {} exits: out of work", rank_));
 	}
 }
 
 bool runner_slave::is_checkpoint_time() {
-	return MPI_Wtime() - time_last_checkpoint_ > job_.checkpoint_time;
+	return MPI_Wtime() - time_last_checkpoint_ > job_.checkpoint_interval(checkpoint_cost_);
 }
 
 bool runner_slave::time_is_up() {
-	return MPI_Wtime() - time_start_ > job_.runtime;
+	return job_.time_is_up(MPI_Wtime() - time_start_, checkpoint_cost_ + merge_cost_);
 }
 
 int runner_slave::what_is_next(int status) {
-	MPI_Send(&status, 1, MPI_INT, MASTER, T_STATUS, MPI_COMM_WORLD);
+	report_merge(false);
+
+	if(status == S_BUSY && query_pending_) {
+		// the previous query is still in flight. Only wait for it if there is nothing left to do.
+		int arrived = action_request_ == MPI_REQUEST_NULL;
+		if(!arrived) {
+			MPI_Test(&action_request_, &arrived, MPI_STATUS_IGNORE);
+		}
+		if(!arrived && sweeps_since_last_query_ < sweeps_before_communication_) {
+			return A_CONTINUE;
+		}
+		int new_action = wait_pending_action();
+		if(new_action != A_CONTINUE) {
+			return react_to_action(new_action);
+		}
+	}
+
+	// The answers are always posted before the query, so that a master on the same rank never
+	// has to wait for us.
 	if(status == S_TIMEUP) {
+		send_status(status);
 		return 0;
 	} else if(status == S_IDLE) {
-		int new_action = recv_action();
+		int new_action;
+		uint64_t msg[3];
+		MPI_Request requests[2];
+		MPI_Irecv(&new_action, 1, MPI_INT, MASTER, T_ACTION, comm_, &requests[0]);
+		MPI_Irecv(msg, sizeof(msg) / sizeof(msg[0]), MPI_UINT64_T, MASTER, T_NEW_JOB, comm_,
+		          &requests[1]);
+		send_status(status);
+
+		wait(requests[0]);
 		if(new_action == A_EXIT) {
+			MPI_Cancel(&requests[1]);
+			MPI_Wait(&requests[1], MPI_STATUS_IGNORE);
 			return A_EXIT;
 		}
-		MPI_Status stat;
-		uint64_t msg[3];
-		MPI_Recv(&msg, sizeof(msg) / sizeof(msg[0]), MPI_UINT64_T, 0, T_NEW_JOB, MPI_COMM_WORLD,
-		         &stat);
+		wait(requests[1]);
 		task_id_ = msg[0];
 		run_id_ = msg[1];
 		sweeps_before_communication_ = msg[2];
@@ -229,43 +605,232 @@ int runner_slave::what_is_next(int status) {
 	}
 
 	assert(task_id_ >= 0);
-	uint64_t msg[2] = {static_cast<uint64_t>(task_id_), sweeps_since_last_query_};
-	MPI_Send(msg, sizeof(msg) / sizeof(msg[0]), MPI_UINT64_T, 0, T_STATUS, MPI_COMM_WORLD);
+	MPI_Irecv(&pending_action_, 1, MPI_INT, MASTER, T_ACTION, comm_, &action_request_);
+	query_pending_ = true;
+
+	send_status(status, {static_cast<uint64_t>(task_id_), sweeps_since_last_query_});
 	sweeps_since_last_query_ = 0;
-	int new_action = recv_action();
-	if(new_action == A_PROCESS_DATA_NEW_JOB) {
+
+	if(overlap_communication_) {
+		return A_CONTINUE;
+	}
+
+	return react_to_action(wait_pending_action());
+}
+
+int runner_slave::react_to_action(int action) {
+	if(action == A_PROCESS_DATA_NEW_JOB) {
 		merge_measurements();
 		return what_is_next(S_IDLE);
 	}
-	if(new_action == A_NEW_JOB) {
+	if(action == A_NEW_JOB) {
 		return what_is_next(S_IDLE);
 	}
-	if(new_action == A_EXIT) {
+	if(action == A_EXIT) {
 		return A_EXIT;
 	}
 
 	return A_CONTINUE;
 }
 
-int runner_slave::recv_action() {
-	MPI_Status stat;
-	int new_action;
-	MPI_Recv(&new_action, 1, MPI_INT, MASTER, T_ACTION, MPI_COMM_WORLD, &stat);
-	return new_action;
+// Polls the pending status query. Returns true if the master wants us to stop working on the
+// current task. An A_CONTINUE answer just clears the query so that the next one can be posted.
+bool runner_slave::action_arrived() {
+	if(!query_pending_ || action_request_ == MPI_REQUEST_NULL) {
+		return query_pending_;
+	}
+
+	int arrived;
+	MPI_Test(&action_request_, &arrived, MPI_STATUS_IGNORE);
+	if(arrived && pending_action_ == A_CONTINUE) {
+		query_pending_ = false;
+		return false;
+	}
+	return arrived;
+}
+
+int runner_slave::wait_pending_action() {
+	assert(query_pending_);
+	wait(action_request_);
+	query_pending_ = false;
+	return pending_action_;
+}
+
+void runner_slave::wait(MPI_Request &request) {
+	if(!poll_master_) {
+		MPI_Wait(&request, MPI_STATUS_IGNORE);
+		return;
+	}
+
+	int done;
+	MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+	while(!done) {
+		poll_master_();
+		MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+	}
+}
+
+// both messages have to be posted before waiting because the master receives them in one go.
+void runner_slave::send_status(int status, const std::vector<uint64_t> &msg) {
+	MPI_Request requests[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+	MPI_Isend(&status, 1, MPI_INT, MASTER, T_STATUS, comm_, &requests[0]);
+	if(!msg.empty()) {
+		MPI_Isend(msg.data(), msg.size(), MPI_UINT64_T, MASTER, T_STATUS, comm_, &requests[1]);
+	}
+	wait(requests[0]);
+	wait(requests[1]);
+}
+
+// Blocks until the master allows us to access the file system. Without mc_io_concurrency,
+// the master grants every request right away, so we do not even ask.
+void runner_slave::acquire_io() {
+	if(!io_throttled_) {
+		return;
+	}
+
+	int grant;
+	MPI_Request request;
+	MPI_Irecv(&grant, 1, MPI_INT, MASTER, T_IO_GRANT, comm_, &request);
+	send_status(S_IO_REQUEST);
+	wait(request);
+}
+
+void runner_slave::release_io() {
+	if(io_throttled_) {
+		send_status(S_IO_DONE);
+	}
+}
+
+void runner_slave::start_workers() {
+	stop_workers_ = false;
+	for(int i = 1; i < threads_; i++) {
+		workers_.emplace_back([this, i]() {
+			try {
+				if(!thread_cores_.empty()) {
+					pin_thread(thread_cores_[i]);
+				}
+				auto &sys = *sys_[i];
+				while(!stop_workers_) {
+					sys._do_update();
+
+					if(sys.is_thermalized()) {
+						sys._do_measurement();
+						worker_sweeps_++;
+					}
+				}
+			} catch(...) {
+				worker_errors_[i] = std::current_exception();
+				stop_workers_ = true;
+			}
+		});
+	}
+}
+
+void runner_slave::stop_workers() {
+	stop_workers_ = true;
+	for(auto &worker : workers_) {
+		worker.join();
+	}
+	workers_.clear();
+
+	sweeps_since_last_query_ += worker_sweeps_;
+	sweeps_done_.fetch_add(worker_sweeps_, std::memory_order_relaxed);
+	worker_sweeps_ = 0;
+
+	for(auto &error : worker_errors_) {
+		if(error) {
+			std::rethrow_exception(error);
+		}
+	}
 }
 
 void runner_slave::checkpoint_write() {
+	std::lock_guard<std::recursive_mutex> lock{hdf5_mutex_};
+	acquire_io();
+	checkpoint_finalize();
 	time_last_checkpoint_ = MPI_Wtime();
-	sys_->_write(job_.rundir(task_id_, run_id_));
-	sys_->_write_finalize(job_.rundir(task_id_, run_id_));
-	job_.log(
-	    fmt::format("* rank {}: checkpoint {}", rank_, job_.rundir(task_id_, run_id_).string()));
+	for(size_t i = 0; i < sys_.size(); i++) {
+		std::string rundir = job_.rundir(task_id_, run_id_ + i);
+		if(async_checkpoint_) {
+			sys_[i]->_write_async(rundir);
+			pending_checkpoints_.push_back(rundir);
+		} else {
+			sys_[i]->_write(rundir);
+			sys_[i]->_write_finalize(rundir);
+		}
+		job_.log(fmt::format("* rank {}: checkpoint {}", rank_, rundir));
+	}
+	checkpoint_cost_ = MPI_Wtime() - time_last_checkpoint_;
+	release_io();
+}
+
+void runner_slave::checkpoint_finalize() {
+	for(size_t i = 0; i < pending_checkpoints_.size(); i++) {
+		sys_[i]->_write_finalize(pending_checkpoints_[i]);
+	}
+	pending_checkpoints_.clear();
 }
 
 void runner_slave::merge_measurements() {
 	std::filesystem::path unique_filename = job_.taskdir(task_id_);
-	sys_->write_output(unique_filename);
+	if(!background_merge_) {
+		double start = MPI_Wtime();
+		sys_[0]->write_output(unique_filename);
+		job_.merge_task(task_id_);
+		merge_cost_ = MPI_Wtime() - start;
+		merged_task_id_ = task_id_;
+		report_merge(true);
+		return;
+	}
+
+	// only one merge at a time
+	report_merge(true);
+
+	// write_output still needs the current mc instance, so it is done right away.
+	{
+		std::lock_guard<std::recursive_mutex> lock{hdf5_mutex_};
+		sys_[0]->write_output(unique_filename);
+	}
+
+	// The merge only takes hdf5_mutex_ for the single HDF5 calls, so the next task can read its
+	// dump and checkpoint in the meantime. It gets its own copy of the job because the jobfile
+	// is also used by the next task.
+	merged_task_id_ = task_id_;
+	merge_finished_ = false;
+	merge_thread_ = std::thread{[this, job = job_, task_id = task_id_]() mutable {
+		try {
+			auto start = std::chrono::steady_clock::now();
+			size_t sweeps_before = sweeps_done_;
+			job.merge_task(task_id);
+			merge_cost_ =
+			    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			job.log(fmt::format("rank {}: merged {} in the background in {:.2f}s during {} sweeps",
+			                    rank_, job.task_names[task_id], merge_cost_.load(),
+			                    sweeps_done_ - sweeps_before));
+		} catch(...) {
+			merge_error_ = std::current_exception();
+		}
+		merge_finished_ = true;
+	}};
+}
+
+void runner_slave::join_merge() {
+	if(merge_thread_.joinable()) {
+		merge_thread_.join();
+	}
+
+	if(merge_error_) {
+		std::rethrow_exception(std::exchange(merge_error_, nullptr));
+	}
+}
+
+void runner_slave::report_merge(bool wait) {
+	if(merged_task_id_ < 0 || (!wait && merge_thread_.joinable() && !merge_finished_)) {
+		return;
+	}
 
-	job_.merge_task(task_id_);
+	join_merge();
+	send_status(S_MERGED, {static_cast<uint64_t>(merged_task_id_)});
+	merged_task_id_ = -1;
 }
 }
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <map>
 #include <mpi.h>
+#include <mutex>
 #include <ostream>
+#include <thread>
 #include <vector>
 
 #include "jobinfo.h"
@@ -15,34 +21,121 @@ namespace loadl {
 
 int runner_mpi_start(jobinfo job, const mc_factory &mccreator, int argc, char **argv);
 
+class runner_slave;
+
 class runner_master {
 private:
 	jobinfo job_;
+	MPI_Comm comm_;
+
+	// in hierarchical mode, this master only schedules the slaves in comm_ and leases
+	// its tasks from the top-level master.
+	bool is_submaster_{false};
+	// the top-level master has no tasks left to lease.
+	bool leases_exhausted_{false};
 
 	int num_active_ranks_{0};
+	int runs_per_rank_{1};
 
 	std::vector<runner_task> tasks_;
 	int current_task_id_{-1};
 
+	// number of merges that were started but not reported as done with S_MERGED. Then the
+	// task's row in the HDF5 job results is updated, or in hierarchical mode, the top-level master
+	// is told to do it. The JSON job results are written at the end.
+	int pending_merges_{0};
+
+	// I/O tokens: at most io_limit_ slaves read dumps or write checkpoints at the same time.
+	// The others wait in io_queue_ with the time they asked.
+	int io_limit_{0};
+	int io_active_{0};
+	std::deque<std::pair<int, double>> io_queue_;
+	double io_wait_time_{0};
+	int io_delayed_requests_{0};
+
 	void read();
 	int get_new_task_id(int old_id);
+	int lease_task();
 
 	void react();
 	void send_action(int action, int destination);
+	void grant_io(int node);
+
+public:
+	runner_master(jobinfo job, MPI_Comm comm = MPI_COMM_WORLD, bool is_submaster = false);
+
+	// If local_slave is given, it is run on the master rank and polls the master in between
+	// its sweeps.
+	int start(runner_slave *local_slave = nullptr);
+
+	// handles all status messages that have arrived without blocking.
+	void poll();
+};
+
+// In hierarchical mode, rank 0 only hands out tasks to the sub-masters, which do the
+// sweep accounting for their own slaves. That way the message rate on rank 0 scales with
+// the number of sub-masters instead of the number of ranks.
+class runner_top_master {
+private:
+	jobinfo job_;
+
+	int num_active_submasters_{0};
+	bool submasters_done_{true};
+
+	std::vector<runner_task> tasks_;
+	int current_task_id_{-1};
+
+	void read();
+	void react();
 
 public:
-	runner_master(jobinfo job);
+	runner_top_master(jobinfo job);
 	int start();
 };
 
 class runner_slave {
 private:
 	jobinfo job_;
+	MPI_Comm comm_;
 
 	mc_factory mccreator_;
-	std::unique_ptr<mc> sys_;
+
+	// hybrid mode: every thread works on its own run of the current task. sys_[0] belongs to
+	// the main thread, which also does all the communication and I/O.
+	std::vector<std::unique_ptr<mc>> sys_;
+	int threads_{1};
+	std::vector<int> thread_cores_; // empty if threads are not pinned
+	std::vector<std::thread> workers_;
+	std::vector<std::exception_ptr> worker_errors_;
+	std::atomic<bool> stop_workers_{false};
+	std::atomic<size_t> worker_sweeps_{0};
+
+	// merges can run in the background while we work on the next task. Serial HDF5 is not
+	// thread-safe, so all file access goes through hdf5_mutex_. It is shared with the mc
+	// instances, which may flush their measurements from the worker threads.
+	bool background_merge_{false};
+	std::thread merge_thread_;
+	// measured sweeps of all threads. Those of the worker threads are added when they stop.
+	// Used to log how much work was done during a background merge.
+	std::atomic<size_t> sweeps_done_{0};
+	std::exception_ptr merge_error_;
+	// the task of the last merge until the master was told that it is done.
+	int merged_task_id_{-1};
+	std::atomic<bool> merge_finished_{false};
+	std::recursive_mutex &hdf5_mutex_{iodump::mutex()};
+
+	// asynchronous checkpoints finalize themselves once written. Their writer threads are only
+	// joined when the next one is due or before the mc instances are replaced.
+	bool async_checkpoint_{false};
+	std::vector<std::string> pending_checkpoints_;
+
+	bool io_throttled_{false};
 
 	double time_last_checkpoint_{0};
+	double checkpoint_cost_{0}; // duration of the last checkpoint
+	// duration of the last merge. Together with checkpoint_cost_, this is the time we need to
+	// shut down cleanly.
+	std::atomic<double> merge_cost_{0};
 	double time_start_{0};
 
 	int rank_{0};
@@ -51,16 +144,40 @@ private:
 	int task_id_{-1};
 	int run_id_{-1};
 
+	// non-blocking protocol: the status query is posted and sweeps continue until the answer
+	// arrives.
+	bool overlap_communication_{false};
+	bool query_pending_{false};
+	MPI_Request action_request_{MPI_REQUEST_NULL};
+	int pending_action_{};
+
+	// set if the master runs on the same rank and has to be kept alive while we work.
+	std::function<void()> poll_master_;
+
 	bool is_checkpoint_time();
 	bool time_is_up();
 	void end_of_run();
-	int recv_action();
+	void wait(MPI_Request &request);
+	void send_status(int status, const std::vector<uint64_t> &msg = {});
 	int what_is_next(int);
+	int react_to_action(int action);
+	bool action_arrived();
+	int wait_pending_action();
 	void checkpoint_write();
+	void checkpoint_finalize();
+	void acquire_io();
+	void release_io();
 	void merge_measurements();
+	void join_merge();
+	// sends S_MERGED once the last merge is done. If wait is false, this does nothing while it
+	// is still running.
+	void report_merge(bool wait);
+	void start_workers();
+	void stop_workers();
 
 public:
-	runner_slave(jobinfo job, mc_factory mccreator);
-	void start();
+	runner_slave(jobinfo job, mc_factory mccreator, MPI_Comm comm = MPI_COMM_WORLD,
+	             std::vector<int> thread_cores = {});
+	void start(std::function<void()> poll_master = {});
 };
 }
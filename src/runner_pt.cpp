@@ -139,14 +139,18 @@ int runner_pt_start(jobinfo job, const mc_factory &mccreator, int argc, char **a
 	int rc = 0;
 
 	if(rank == 0) {
-		runner_pt_master r{std::move(job)};
+		runner_pt_master r{job};
 		rc = r.start();
 	} else {
 		runner_pt_slave r{std::move(job), mccreator};
 		r.start();
 	}
 
+	// all merges are done after the barrier.
 	MPI_Barrier(MPI_COMM_WORLD);
+	if(rank == 0) {
+		job.concatenate_results();
+	}
 	MPI_Finalize();
 
 	return rc;
@@ -353,6 +357,9 @@ int runner_pt_master::start() {
 	}
 
 	job_.log(fmt::format("starting job '{}' in parallel tempering mode", job_.jobname));
+	if(job_.jobfile["jobconfig"].get<bool>("mc_master_does_work", false)) {
+		job_.log("mc_master_does_work is not supported in parallel tempering mode. Ignoring it.");
+	}
 	checkpoint_read();
 
 	std::vector<int> group_idx(num_active_ranks_);
@@ -388,7 +395,11 @@ int runner_pt_master::start() {
 		}
 	}
 
-	job_.log(fmt::format("master: stopping due to {}", all_done ? "completion" : "time limit"));
+	const char *reason = all_done ? "completion" : "time limit";
+	if(!all_done && jobinfo::stop_signal_received()) {
+		reason = "stop signal";
+	}
+	job_.log(fmt::format("master: stopping due to {}", reason));
 	return !all_done;
 }
 
@@ -639,7 +650,8 @@ void runner_pt_slave::start() {
 
 		if(timeout == TR_TIMEUP) {
 			send_status(S_TIMEUP);
-			job_.log(fmt::format("rank {} exits: time up", rank_));
+			job_.log(fmt::format("rank {} exits: {}", rank_,
+			                     jobinfo::stop_signal_received() ? "stop signal" : "time up"));
 			break;
 		}
 		action = what_is_next(S_BUSY);
@@ -657,11 +669,11 @@ void runner_pt_slave::send_status(int status) {
 int runner_pt_slave::negotiate_timeout() {
 	int result = TR_CONTINUE;
 	if(chain_rank_ == 0) {
-		if(MPI_Wtime() - time_last_checkpoint_ > job_.checkpoint_time) {
+		if(MPI_Wtime() - time_last_checkpoint_ > job_.checkpoint_interval(checkpoint_cost_)) {
 			result = TR_CHECKPOINT;
 		}
 
-		if(MPI_Wtime() - time_start_ > job_.runtime) {
+		if(job_.time_is_up(MPI_Wtime() - time_start_, checkpoint_cost_)) {
 			result = TR_TIMEUP;
 		}
 	}
@@ -736,6 +748,7 @@ bool runner_pt_slave::accept_new_chain() {
 		checkpoint_write();
 	} else {
 		job_.log(fmt::format("* read {}", job_.rundir(task_id_, run_id_).string()));
+		checkpoint_cost_ = sys_->checkpoint_write_time();
 	}
 
 	return true;
@@ -774,6 +787,7 @@ void runner_pt_slave::checkpoint_write() {
 	sys_->_write_finalize(job_.rundir(task_id_, run_id_));
 	job_.log(
 	    fmt::format("* rank {}: checkpoint {}", rank_, job_.rundir(task_id_, run_id_).string()));
+	checkpoint_cost_ = MPI_Wtime() - time_last_checkpoint_;
 }
 
 void runner_pt_master::send_action(int action, int destination) {
@@ -102,6 +102,7 @@ private:
 	int chain_rank_{};
 
 	double time_last_checkpoint_{0};
+	double checkpoint_cost_{0}; // duration of the last checkpoint
 	double time_start_{0};
 
 	int rank_{};
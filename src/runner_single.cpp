@@ -2,6 +2,7 @@
 #include "iodump.h"
 #include "merger.h"
 
+#include <chrono>
 #include <fmt/format.h>
 #include <fstream>
 #include <iostream>
@@ -10,8 +11,10 @@
 namespace loadl {
 
 int runner_single_start(jobinfo job, const mc_factory &mccreator, int, char **) {
-	runner_single r{std::move(job), mccreator};
-	return r.start();
+	runner_single r{job, mccreator};
+	int rc = r.start();
+	job.concatenate_results();
+	return rc;
 }
 
 runner_single::runner_single(jobinfo job, mc_factory mccreator)
@@ -20,16 +23,19 @@ runner_single::runner_single(jobinfo job, mc_factory mccreator)
 int runner_single::start() {
 	time_start_ = time(nullptr);
 	time_last_checkpoint_ = time_start_;
+	async_checkpoint_ = job_.jobfile["jobconfig"].get<bool>("mc_async_checkpoint", false);
 
 	read();
 	task_id_ = get_new_task_id(task_id_);
 	while(task_id_ != -1 && !time_is_up()) {
+		checkpoint_finalize();
 		sys_ = std::unique_ptr<mc>{mccreator_(job_.jobfile["tasks"][job_.task_names.at(task_id_)])};
 		if(!sys_->_read(job_.rundir(task_id_, 1))) {
 			sys_->_init();
 			job_.log(fmt::format("* initialized {}", job_.rundir(task_id_, 1).string()));
 		} else {
 			job_.log(fmt::format("* read {}", job_.rundir(task_id_, 1).string()));
+			checkpoint_cost_ = sys_->checkpoint_write_time();
 		}
 
 		while(!tasks_[task_id_].is_done() && !time_is_up()) {
@@ -49,16 +55,18 @@ int runner_single::start() {
 		task_id_ = get_new_task_id(task_id_);
 	}
 
+	checkpoint_finalize();
+
 	bool all_done = task_id_ < 0;
 	return !all_done;
 }
 
 bool runner_single::is_checkpoint_time() const {
-	return time(nullptr) - time_last_checkpoint_ > job_.checkpoint_time;
+	return time(nullptr) - time_last_checkpoint_ > job_.checkpoint_interval(checkpoint_cost_);
 }
 
 bool runner_single::time_is_up() const {
-	return time(nullptr) - time_start_ > job_.runtime;
+	return job_.time_is_up(time(nullptr) - time_start_, checkpoint_cost_ + merge_cost_);
 }
 
 int runner_single::get_new_task_id(int old_id) {
@@ -87,17 +95,37 @@ void runner_single::read() {
 }
 
 void runner_single::checkpointing() {
+	auto start = std::chrono::steady_clock::now();
+	checkpoint_finalize();
 	time_last_checkpoint_ = time(nullptr);
-	sys_->_write(job_.rundir(task_id_, 1).string());
-	sys_->_write_finalize(job_.rundir(task_id_, 1));
+	std::string rundir = job_.rundir(task_id_, 1);
+	if(async_checkpoint_) {
+		sys_->_write_async(rundir);
+		pending_checkpoint_ = rundir;
+	} else {
+		sys_->_write(rundir);
+		sys_->_write_finalize(rundir);
+	}
 	job_.log(fmt::format("* checkpointing {}", job_.rundir(task_id_, 1).string()));
+	checkpoint_cost_ =
+	    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void runner_single::checkpoint_finalize() {
+	if(!pending_checkpoint_.empty()) {
+		sys_->_write_finalize(pending_checkpoint_);
+		pending_checkpoint_.clear();
+	}
 }
 
 void runner_single::merge_measurements() {
+	auto start = std::chrono::steady_clock::now();
 	std::filesystem::path unique_filename = job_.taskdir(task_id_);
 	sys_->write_output(unique_filename);
 
 	job_.log(fmt::format("merging {}", job_.taskdir(task_id_).string()));
 	job_.merge_task(task_id_);
+	merge_cost_ =
+	    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 }
 }
@@ -22,6 +22,11 @@ private:
 
 	double time_start_{0};
 	double time_last_checkpoint_{0};
+	double checkpoint_cost_{0}; // duration of the last checkpoint
+	double merge_cost_{0};      // duration of the last merge
+
+	bool async_checkpoint_{false};
+	std::string pending_checkpoint_; // empty if there is none
 
 	void read();
 	int get_new_task_id(int old_id);
@@ -30,6 +35,7 @@ private:
 	bool is_checkpoint_time() const;
 
 	void checkpointing();
+	void checkpoint_finalize();
 	void merge_measurements();
 
 public:
@@ -1,6 +1,8 @@
 #include "util.h"
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <complex>
 
 namespace loadl {
 
@@ -69,4 +71,106 @@ double monotonic_interpolator::operator()(double x0) {
 	return y_[idx] * h00(t) + del * m_[idx] * h10(t) + y_[idx + 1] * h01(t) +
 	       del * m_[idx + 1] * h11(t);
 }
+
+// in-place radix-2 FFT. data.size() has to be a power of two.
+static void fft(std::vector<std::complex<double>> &data, bool inverse) {
+	size_t n = data.size();
+	for(size_t i = 1, j = 0; i < n; i++) {
+		size_t bit = n >> 1;
+		for(; j & bit; bit >>= 1) {
+			j ^= bit;
+		}
+		j ^= bit;
+		if(i < j) {
+			std::swap(data[i], data[j]);
+		}
+	}
+
+	for(size_t len = 2; len <= n; len <<= 1) {
+		double angle = 2 * M_PI / len * (inverse ? 1 : -1);
+		std::complex<double> root{cos(angle), sin(angle)};
+		for(size_t i = 0; i < n; i += len) {
+			std::complex<double> w{1};
+			for(size_t j = 0; j < len / 2; j++) {
+				auto u = data[i + j];
+				auto v = data[i + j + len / 2] * w;
+				data[i + j] = u + v;
+				data[i + j + len / 2] = u - v;
+				w *= root;
+			}
+		}
+	}
+}
+
+autocorrelation::autocorrelation(size_t vector_length) : vector_length_{vector_length} {}
+
+void autocorrelation::add_series(const std::vector<double> &series, size_t count) {
+	assert(series.size() >= count * vector_length_);
+	if(count == 0) {
+		return;
+	}
+
+	if(pair_counts_.size() < count) {
+		pair_counts_.resize(count, 0);
+		covariance_sums_.resize(count * vector_length_, 0);
+	}
+	for(size_t lag = 0; lag < count; lag++) {
+		pair_counts_[lag] += count - lag;
+	}
+
+	// zero padding to twice the length avoids the periodic wrap-around.
+	size_t size = 1;
+	while(size < 2 * count) {
+		size <<= 1;
+	}
+
+	std::vector<std::complex<double>> data(size);
+	for(size_t j = 0; j < vector_length_; j++) {
+		double mean = 0;
+		for(size_t i = 0; i < count; i++) {
+			mean += series[i * vector_length_ + j];
+		}
+		mean /= count;
+
+		std::fill(data.begin(), data.end(), 0);
+		for(size_t i = 0; i < count; i++) {
+			data[i] = series[i * vector_length_ + j] - mean;
+		}
+
+		fft(data, false);
+		for(auto &d : data) {
+			d = std::norm(d);
+		}
+		fft(data, true);
+
+		for(size_t lag = 0; lag < count; lag++) {
+			covariance_sums_[lag * vector_length_ + j] += data[lag].real() / size;
+		}
+	}
+}
+
+std::vector<double> autocorrelation::integrated_time(double window_factor) const {
+	std::vector<double> times(vector_length_, 0);
+	if(pair_counts_.empty()) {
+		return times;
+	}
+
+	for(size_t j = 0; j < vector_length_; j++) {
+		double variance = covariance_sums_[j] / pair_counts_[0];
+		if(variance <= 0) {
+			continue;
+		}
+
+		double tau = 0.5;
+		for(size_t lag = 1; lag < pair_counts_.size(); lag++) {
+			tau += covariance_sums_[lag * vector_length_ + j] / pair_counts_[lag] / variance;
+			if(lag >= window_factor * tau) {
+				break;
+			}
+		}
+		times[j] = tau;
+	}
+
+	return times;
+}
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 #include <vector>
 
 namespace loadl {
@@ -16,4 +17,26 @@ public:
 	double operator()(double x0);
 };
 
+// Accumulates the autocorrelation function of a vector quantity from independent time series,
+// like the bins of different runs. Each series is transformed with an FFT, so this takes
+// O(N log N).
+class autocorrelation {
+private:
+	size_t vector_length_;
+	// sums of (x_i - mean)(x_{i+lag} - mean) and the number of terms in them.
+	std::vector<double> covariance_sums_; // [lag * vector_length + vector_idx]
+	std::vector<size_t> pair_counts_;     // [lag]
+
+public:
+	explicit autocorrelation(size_t vector_length);
+
+	// series holds count samples of vector_length values one after the other.
+	void add_series(const std::vector<double> &series, size_t count);
+
+	// integrated autocorrelation time 1/2 + sum_{t=1}^W rho(t) of every vector component in
+	// units of the sample spacing, with Sokal’s self-consistent window, the smallest W with
+	// W >= window_factor * tau(W).
+	std::vector<double> integrated_time(double window_factor = 5) const;
+};
+
 }
@@ -0,0 +1,39 @@
+#include "random.h"
+#include "util.h"
+#include <catch2/catch.hpp>
+
+using namespace loadl;
+
+TEST_CASE("autocorrelation time of AR(1) processes") {
+	random_number_generator rng{1337};
+
+	// x_{t+1} = phi x_t + noise has rho(t) = phi^t and tau = (1 + phi)/(2 (1 - phi)).
+	std::vector<double> phis = {0, 0.5, 0.9};
+	autocorrelation acorr{phis.size()};
+
+	size_t nseries = 4;
+	size_t count = 100000;
+	for(size_t s = 0; s < nseries; s++) {
+		std::vector<double> series(count * phis.size());
+		std::vector<double> x(phis.size(), 0);
+		for(size_t i = 0; i < count; i++) {
+			for(size_t j = 0; j < phis.size(); j++) {
+				x[j] = phis[j] * x[j] + rng.random_double() - 0.5;
+				series[i * phis.size() + j] = x[j];
+			}
+		}
+		acorr.add_series(series, count);
+	}
+
+	auto times = acorr.integrated_time();
+	for(size_t j = 0; j < phis.size(); j++) {
+		double tau = (1 + phis[j]) / (2 * (1 - phis[j]));
+		REQUIRE(times[j] == Approx(tau).epsilon(0.05));
+	}
+}
+
+TEST_CASE("autocorrelation of a constant") {
+	autocorrelation acorr{1};
+	acorr.add_series(std::vector<double>(10, 1.), 10);
+	REQUIRE(acorr.integrated_time()[0] == 0);
+}
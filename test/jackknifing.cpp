@@ -31,8 +31,8 @@ TEST_CASE("square of uniform distribution") {
 			double error = sqrt((squared_sum - nsamples * mean * mean) / (nsamples - 1));
 
 			std::string name = fmt::format("Uniform{}", var);
-			res.observables[name] =
-			    observable_result{name, 1, nsamples, samples, nsamples, 0, {mean}, {error}, {0.}};
+			res.observables[name] = observable_result{
+			    name, 1, nsamples, samples, nsamples, 0, {mean}, {error}, {0.}, {}};
 		}
 
 		evaluator eval{res};
@@ -62,3 +62,130 @@ TEST_CASE("square of uniform distribution") {
 	REQUIRE(tries_mean == Approx(0.25).epsilon(0.05));
 	REQUIRE(tries_std == Approx(jackknife_error).epsilon(0.05));
 }
+
+TEST_CASE("batch and threaded evaluation") {
+	random_number_generator rng{1337};
+
+	size_t nbins = 57;
+	results res;
+	for(int var = 0; var < 2; var++) {
+		std::vector<double> bins(2 * nbins);
+		for(auto &b : bins) {
+			b = rng.random_double();
+		}
+		std::string name = fmt::format("Uniform{}", var);
+		res.observables[name] =
+		    observable_result{name, 1, nbins, bins, nbins, 0, {0, 0}, {0, 0}, {0, 0}, {}};
+	}
+
+	auto product = [](const std::vector<std::vector<double>> &obs) {
+		return std::vector<double>{obs[0][0] * obs[1][1], obs[0][1] / obs[1][0]};
+	};
+
+	evaluator eval{res};
+	eval.evaluate("Plain", {"Uniform0", "Uniform1"}, product);
+	eval.evaluate_batch("Batch", {"Uniform0", "Uniform1"},
+	                    [](const std::vector<std::vector<double>> &samples, size_t sample_count) {
+		                    std::vector<double> result;
+		                    for(size_t k = 0; k < sample_count; k++) {
+			                    result.push_back(samples[0][2 * k] * samples[1][2 * k + 1]);
+			                    result.push_back(samples[0][2 * k + 1] / samples[1][2 * k]);
+		                    }
+		                    return result;
+	                    });
+	evaluator threaded_eval{res, 4};
+	threaded_eval.evaluate("Threaded", {"Uniform0", "Uniform1"}, product);
+	eval.append_results();
+	threaded_eval.append_results();
+
+	for(const auto *name : {"Batch", "Threaded"}) {
+		REQUIRE(res.observables[name].mean == res.observables["Plain"].mean);
+		REQUIRE(res.observables[name].error == res.observables["Plain"].error);
+	}
+}
+
+TEST_CASE("delta method") {
+	random_number_generator rng{1337};
+
+	size_t nbins = 1000;
+	results res;
+	for(int var = 0; var < 2; var++) {
+		std::vector<double> bins(nbins);
+		for(auto &b : bins) {
+			b = rng.random_double();
+		}
+		std::string name = fmt::format("Uniform{}", var);
+		res.observables[name] =
+		    observable_result{name, 1, nbins, bins, nbins, 0, {0}, {0}, {0}, {}};
+	}
+
+	auto linear = [](const std::vector<std::vector<double>> &obs) {
+		return std::vector<double>{2 * obs[0][0] - 3 * obs[1][0]};
+	};
+	auto product = [](const std::vector<std::vector<double>> &obs) {
+		return std::vector<double>{obs[0][0] * obs[1][0]};
+	};
+	auto product_gradient = [](const std::vector<std::vector<double>> &obs) {
+		return std::vector<std::vector<double>>{{obs[1][0], obs[0][0]}};
+	};
+
+	using error_method = evaluator::error_method;
+	evaluator eval{res};
+	eval.evaluate("LinearJackknife", {"Uniform0", "Uniform1"}, linear);
+	eval.evaluate("LinearDelta", {"Uniform0", "Uniform1"}, linear, error_method::delta);
+	eval.evaluate("ProductJackknife", {"Uniform0", "Uniform1"}, product);
+	eval.evaluate("ProductDelta", {"Uniform0", "Uniform1"}, product, error_method::delta);
+	eval.evaluate("ProductGradient", {"Uniform0", "Uniform1"}, product, error_method::delta,
+	              product_gradient);
+	eval.append_results();
+
+	auto &obs = res.observables;
+	REQUIRE(obs["LinearDelta"].mean[0] == Approx(obs["LinearJackknife"].mean[0]).epsilon(1e-12));
+	REQUIRE(obs["LinearDelta"].error[0] ==
+	        Approx(obs["LinearJackknife"].error[0]).epsilon(1e-8));
+	REQUIRE(obs["ProductDelta"].mean[0] == Approx(obs["ProductJackknife"].mean[0]).epsilon(1e-3));
+	REQUIRE(obs["ProductDelta"].error[0] ==
+	        Approx(obs["ProductJackknife"].error[0]).epsilon(1e-3));
+	REQUIRE(obs["ProductGradient"].error[0] == Approx(obs["ProductDelta"].error[0]).epsilon(1e-8));
+
+	// the Jacobian of this one would not fit.
+	size_t length = 1 << 13;
+	res.observables["Long"] = observable_result{
+	    "Long", 1, 2, std::vector<double>(2 * length), 2, 0, {}, {}, {}, {}};
+	res.observables["Long"].mean.resize(length);
+	auto identity = [](const std::vector<std::vector<double>> &obs) { return obs[0]; };
+	REQUIRE_THROWS(evaluator{res}.evaluate("LongDelta", {"Long"}, identity, error_method::delta));
+}
+
+TEST_CASE("evalables of evalables") {
+	random_number_generator rng{1337};
+
+	size_t nbins = 100;
+	results res;
+	std::vector<double> bins(nbins);
+	for(auto &b : bins) {
+		b = rng.random_double();
+	}
+	res.observables["Uniform"] =
+	    observable_result{"Uniform", 1, nbins, bins, nbins, 0, {0}, {0}, {0}, {}};
+
+	auto square = [](const std::vector<std::vector<double>> &obs) {
+		return std::vector<double>{obs[0][0] * obs[0][0]};
+	};
+
+	evaluator eval{res};
+	// registered before the evalable it uses
+	eval.evaluate("Fourth", {"Square"}, square);
+	eval.evaluate("Square", {"Uniform"}, square);
+	eval.evaluate("FourthDirect", {"Uniform"}, [](const std::vector<std::vector<double>> &obs) {
+		return std::vector<double>{pow(obs[0][0], 4)};
+	});
+	eval.evaluate("Missing", {"Square", "Nothing"}, square);
+	eval.append_results();
+
+	REQUIRE(res.observables.count("Missing") == 0);
+	REQUIRE(res.observables["Fourth"].mean[0] ==
+	        Approx(res.observables["FourthDirect"].mean[0]).epsilon(1e-12));
+	REQUIRE(res.observables["Fourth"].error[0] ==
+	        Approx(res.observables["FourthDirect"].error[0]).epsilon(1e-8));
+}
@@ -0,0 +1,347 @@
+#include "iodump.h"
+#include "measurements.h"
+#include "merger.h"
+#include <catch2/catch.hpp>
+#include <filesystem>
+#include <fstream>
+
+using namespace loadl;
+
+static std::filesystem::path empty_test_dir(const std::string &name) {
+	auto dir = std::filesystem::temp_directory_path() / ("loadl_test_" + name);
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir);
+	return dir;
+}
+
+// adds the samples [begin, end) to x and appends the completed bins to the measurement file.
+static void measure(measurements &m, const std::string &meas_file, int begin, int end,
+                    size_t max_bins = 0) {
+	for(int i = begin; i < end; i++) {
+		m.add("x", static_cast<double>(i));
+	}
+	iodump file = iodump::open_readwrite(meas_file);
+	m.samples_write(file.get_root(), max_bins);
+}
+
+static void checkpoint(measurements &m, const std::string &dump_file) {
+	iodump file = iodump::create(dump_file);
+	m.checkpoint_write(file.get_root());
+}
+
+static void restart(measurements &m, const std::string &meas_file, const std::string &dump_file) {
+	{
+		iodump file = iodump::open_readonly(dump_file);
+		m.checkpoint_read(file.get_root());
+	}
+	iodump file = iodump::open_readwrite(meas_file);
+	m.samples_truncate(file.get_root());
+}
+
+TEST_CASE("samples appended after the checkpoint are dropped on restart") {
+	auto dir = empty_test_dir("append");
+	std::string meas_file = dir / "run0001.meas.h5";
+	std::string dump_file = dir / "run0001.dump.h5";
+
+	{
+		measurements m{1};
+		measure(m, meas_file, 0, 10);
+		checkpoint(m, dump_file);
+		// flushed early, but the job is killed before the next checkpoint.
+		measure(m, meas_file, 10, 15);
+	}
+
+	measurements m{1};
+	restart(m, meas_file, dump_file);
+	measure(m, meas_file, 10, 20);
+
+	auto obs = merge({meas_file}, 1).observables.at("x");
+	REQUIRE(obs.total_sample_count == 20);
+	REQUIRE(obs.mean[0] == Approx(9.5));
+
+	std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("bin length doubling across a restart") {
+	auto dir = empty_test_dir("doubling");
+	std::string meas_file = dir / "run0001.meas.h5";
+	std::string dump_file = dir / "run0001.dump.h5";
+	const size_t max_bins = 4;
+
+	{
+		measurements m{1};
+		measure(m, meas_file, 0, 10, max_bins);
+		checkpoint(m, dump_file);
+		// the bins written after the checkpoint are doubled once more before the job is killed.
+		measure(m, meas_file, 10, 31, max_bins);
+	}
+
+	measurements m{1};
+	restart(m, meas_file, dump_file);
+	measure(m, meas_file, 10, 100, max_bins);
+	checkpoint(m, dump_file);
+
+	auto obs = merge({meas_file}, 1).observables.at("x");
+	// the bins hold the samples 0, 1, 2, ... without gaps or duplicates.
+	size_t samples = obs.total_sample_count * obs.internal_bin_length;
+	REQUIRE(obs.internal_bin_length == 32);
+	REQUIRE(obs.total_sample_count == 3);
+	REQUIRE(obs.mean[0] == Approx((samples - 1) / 2.));
+
+	std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("interrupted bin length doubling") {
+	auto dir = empty_test_dir("interrupted");
+	std::string meas_file = dir / "run0001.meas.h5";
+
+	{
+		iodump file = iodump::create(meas_file);
+		auto g = file.get_root().open_group("x");
+		g.write("vector_length", size_t{1});
+		g.write("bin_length", size_t{1});
+		g.insert_back("samples", std::vector<double>{0, 1, 2, 3, 4, 5, 6, 7});
+		auto doubling = g.open_group("doubling");
+		doubling.insert_back("samples", std::vector<double>{0.5, 2.5, 4.5, 6.5});
+	}
+
+	auto merged = [&]() { return merge({meas_file}, 1).observables.at("x"); };
+	auto modify = [&](auto f) {
+		iodump file = iodump::open_readwrite(meas_file);
+		f(file.get_root().open_group("x"));
+	};
+
+	// the new bin length is not written yet: the old samples count.
+	REQUIRE(merged().internal_bin_length == 1);
+	REQUIRE(merged().total_sample_count == 8);
+
+	modify([](const iodump::group &g) { g.open_group("doubling").write("bin_length", size_t{2}); });
+	REQUIRE(merged().internal_bin_length == 1);
+
+	modify([](const iodump::group &g) { g.remove("samples"); });
+	REQUIRE(merged().internal_bin_length == 2);
+	REQUIRE(merged().total_sample_count == 4);
+	REQUIRE(merged().mean[0] == Approx(3.5));
+
+	modify([](const iodump::group &g) { g.move("doubling/samples", "samples"); });
+	REQUIRE(merged().internal_bin_length == 2);
+	REQUIRE(merged().total_sample_count == 4);
+
+	modify([](const iodump::group &g) {
+		observable::repair_file_layout(g);
+		REQUIRE(!g.exists("doubling"));
+		size_t bin_length;
+		g.read("bin_length", bin_length);
+		REQUIRE(bin_length == 2);
+	});
+	REQUIRE(merged().internal_bin_length == 2);
+	REQUIRE(merged().total_sample_count == 4);
+
+	std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("packed observable that is measured less often leaves its pack") {
+	auto dir = empty_test_dir("packed");
+	std::string meas_file = dir / "run0001.meas.h5";
+	std::string dump_file = dir / "run0001.dump.h5";
+
+	auto measure_packed = [&](measurements &m, int begin, int end, bool measure_b) {
+		for(int i = begin; i < end; i++) {
+			m.add("a", static_cast<double>(i));
+			if(measure_b) {
+				m.add("b", static_cast<double>(i));
+			}
+		}
+		iodump file = iodump::open_readwrite(meas_file);
+		m.samples_write(file.get_root());
+	};
+
+	{
+		measurements m{1, 0, true};
+		measure_packed(m, 0, 10, true);
+		checkpoint(m, dump_file);
+		measure_packed(m, 10, 15, false);
+		measure_packed(m, 15, 20, true);
+	}
+
+	auto res = merge({meas_file}, 1);
+	REQUIRE(res.observables.at("a").total_sample_count == 20);
+	REQUIRE(res.observables.at("a").mean[0] == Approx(9.5));
+	REQUIRE(res.observables.at("b").total_sample_count == 15);
+	REQUIRE(res.observables.at("b").mean[0] == Approx((45. + 85.) / 15));
+
+	// b stays on its own after a restart from before it left.
+	measurements m{1, 0, true};
+	restart(m, meas_file, dump_file);
+	measure_packed(m, 10, 20, true);
+
+	res = merge({meas_file}, 1);
+	REQUIRE(res.observables.at("a").total_sample_count == 20);
+	REQUIRE(res.observables.at("b").total_sample_count == 20);
+	REQUIRE(res.observables.at("b").mean[0] == Approx(9.5));
+
+	std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("packed checkpoints keep the partial bins") {
+	auto dir = empty_test_dir("packed_checkpoint");
+	std::string meas_file = dir / "run0001.meas.h5";
+	std::string dump_file = dir / "run0001.dump.h5";
+
+	auto measure_packed = [&](measurements &m, int begin, int end) {
+		for(int i = begin; i < end; i++) {
+			m.add("a", static_cast<double>(i));
+			m.add("v", std::vector<double>{static_cast<double>(i), -static_cast<double>(i)});
+		}
+		iodump file = iodump::open_readwrite(meas_file);
+		m.samples_write(file.get_root());
+	};
+
+	{
+		measurements m{3, 0, true};
+		measure_packed(m, 0, 4);
+		checkpoint(m, dump_file);
+	}
+	{
+		iodump file = iodump::open_readonly(dump_file);
+		auto root = file.get_root();
+		REQUIRE(root.exists(observable_pack::group_name));
+		REQUIRE(!root.exists("a"));
+	}
+
+	measurements m{3, 0, true};
+	restart(m, meas_file, dump_file);
+	measure_packed(m, 4, 6);
+
+	auto res = merge({meas_file}, 1);
+	REQUIRE(res.observables.at("a").total_sample_count == 2);
+	REQUIRE(res.observables.at("a").mean[0] == Approx(2.5));
+	REQUIRE(res.observables.at("v").mean[1] == Approx(-2.5));
+
+	std::filesystem::remove_all(dir);
+}
+
+static void require_identical(const results &a, const results &b) {
+	REQUIRE(a.observables.size() == b.observables.size());
+	for(const auto &[name, obs] : a.observables) {
+		const auto &other = b.observables.at(name);
+		REQUIRE(obs.total_sample_count == other.total_sample_count);
+		REQUIRE(obs.rebinning_bin_count == other.rebinning_bin_count);
+		REQUIRE(obs.rebinning_bin_length == other.rebinning_bin_length);
+		REQUIRE(obs.internal_bin_length == other.internal_bin_length);
+		REQUIRE(obs.rebinning_means == other.rebinning_means);
+		REQUIRE(obs.mean == other.mean);
+		REQUIRE(obs.error == other.error);
+		REQUIRE(obs.autocorrelation_time == other.autocorrelation_time);
+	}
+}
+
+TEST_CASE("merge cache gives the same results as a full merge") {
+	auto dir = empty_test_dir("merge_cache");
+	std::vector<std::filesystem::path> meas_files = {dir / "run0001.meas.h5",
+	                                                 dir / "run0002.meas.h5"};
+	std::string dump_file = dir / "run0002.dump.h5";
+	std::string cache_file = dir / "merge_cache.h5";
+	size_t rebinning_bin_length = GENERATE(0, 3);
+	size_t sample_skip = GENERATE(0, 4);
+
+	auto merge_both = [&]() {
+		auto cached = merge(meas_files, rebinning_bin_length, sample_skip, 1, MPI_COMM_NULL,
+		                    cache_file);
+		require_identical(cached, merge(meas_files, rebinning_bin_length, sample_skip));
+	};
+
+	measurements run1{1};
+	measurements run2{2};
+	measure(run1, meas_files[0], 0, 20);
+	measure(run2, meas_files[1], 0, 30);
+	checkpoint(run2, dump_file);
+	measure(run2, meas_files[1], 30, 40);
+	merge_both();
+
+	// new bins in both runs
+	measure(run1, meas_files[0], 20, 37);
+	measure(run2, meas_files[1], 40, 50);
+	merge_both();
+
+	// the second run is restarted from its older checkpoint and measures something else.
+	measurements restarted{2};
+	restart(restarted, meas_files[1], dump_file);
+	measure(restarted, meas_files[1], 1000, 1012);
+	merge_both();
+
+	measure(restarted, meas_files[1], 1012, 1100);
+	merge_both();
+
+	// the cache knows which autocorrelation times it was written for.
+	REQUIRE(merge_cache_is_current(cache_file, meas_files, rebinning_bin_length, sample_skip));
+	REQUIRE(!merge_cache_is_current(cache_file, meas_files, rebinning_bin_length, sample_skip,
+	                                true));
+
+	std::filesystem::remove_all(dir);
+}
+
+static std::vector<char> file_contents(const std::string &filename) {
+	std::ifstream file{filename, std::ios::binary};
+	return {std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+}
+
+TEST_CASE("samples that fit are appended without changing the structure of the file") {
+	auto dir = empty_test_dir("in_place");
+	std::string meas_file = dir / "run0001.meas.h5";
+	bool packed = GENERATE(false, true);
+
+	measurements m{1, 0, packed};
+	measure(m, meas_file, 0, 10);
+	for(int i = 10; i < 15; i++) {
+		m.add("x", static_cast<double>(i));
+	}
+	{
+		iodump file = iodump::open_readonly(meas_file);
+		REQUIRE(m.samples_fit(file.get_root()));
+		// packed observables do not double their bin length.
+		REQUIRE(m.samples_fit(file.get_root(), 12) == packed);
+	}
+
+	auto before = file_contents(meas_file);
+	{
+		iodump file = iodump::open_readwrite(meas_file);
+		m.samples_write(file.get_root());
+	}
+	auto after = file_contents(meas_file);
+
+	// only the new samples and their count are written.
+	REQUIRE(before.size() == after.size());
+	size_t changed_bytes = 0;
+	for(size_t i = 0; i < before.size(); i++) {
+		changed_bytes += before[i] != after[i];
+	}
+	REQUIRE(changed_bytes <= 5 * sizeof(double) + sizeof(size_t));
+
+	auto obs = merge({meas_file}, 1).observables.at("x");
+	REQUIRE(obs.total_sample_count == 15);
+	REQUIRE(obs.mean[0] == Approx(7));
+
+	std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("a measurement file with fewer samples than the checkpoint is refused") {
+	auto dir = empty_test_dir("damaged");
+	std::string meas_file = dir / "run0001.meas.h5";
+	std::string dump_file = dir / "run0001.dump.h5";
+
+	{
+		measurements m{1};
+		measure(m, meas_file, 0, 10);
+		checkpoint(m, dump_file);
+	}
+	{
+		iodump file = iodump::open_readwrite(meas_file);
+		observable::file_samples_truncate(file.get_root().open_group("x"), 5);
+	}
+
+	measurements m{1};
+	REQUIRE_THROWS_AS(restart(m, meas_file, dump_file), std::runtime_error);
+
+	std::filesystem::remove_all(dir);
+}
@@ -1,7 +1,9 @@
 #include "silly_mc.h"
 #include <valarray>
 
-silly_mc::silly_mc(const loadl::parser &p) : loadl::mc(p) {}
+silly_mc::silly_mc(const loadl::parser &p) : loadl::mc(p) {
+	magic_number2_ = measure.get_handle<double>("MagicNumber2");
+}
 
 void silly_mc::do_update() {
 	idx_++;
@@ -10,7 +12,7 @@ void silly_mc::do_update() {
 void silly_mc::do_measurement() {
 	std::vector<double> silly = {1. * idx_, 1. * (3 - idx_ % 5) * idx_};
 	measure.add("MagicNumber", silly);
-	measure.add("MagicNumber2", idx_ * idx_);
+	magic_number2_.add(idx_ * idx_);
 	std::valarray<double> silly2 = {1. * idx_, 1. * (3 - idx_ % 5) * idx_};
 	measure.add("MagicNumberValarray", silly2);
 }
@@ -7,6 +7,7 @@
 class silly_mc : public loadl::mc {
 private:
 	uint64_t idx_;
+	loadl::observable_handle<double> magic_number2_;
 
 public:
 	void init();